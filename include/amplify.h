@@ -0,0 +1,39 @@
+#ifndef AMPLIFY_H
+#define AMPLIFY_H
+
+#include <stdint.h>
+
+#include "statement.h"
+
+/*
+ * Traffic amplification.
+ *
+ * AMPLIFY=N replays every recorded client as N virtual clients.
+ * AMPLIFY_RAMP=1 starts at 1x and adds one virtual client per statistics
+ * interval up to N, reporting where throughput stops growing.
+ * AMPLIFY_KEY_OFFSET=M adds k * M to the integer parameters of the k-th
+ * virtual client, so copies don't all hit the same rows. AMPLIFY_KEY_PARAMS
+ * restricts that to some parameters, e.g. "1,3" (1-based).
+ */
+int amplify_init(void);
+
+/* Largest multiplier we'll ever use, to size the pool. */
+int amplify_max(void);
+
+/* Multiplier in effect right now. */
+int amplify_current(void);
+
+/* Copy of stmt for the k-th virtual client, k > 0. */
+struct PStatement *amplify_clone(struct PStatement *stmt, int k);
+
+/*
+ * Hook to change the copy of a statement for the k-th virtual client.
+ * Defaults to offsetting integer parameters by AMPLIFY_KEY_OFFSET.
+ */
+typedef void (*amplify_perturb_fn)(struct PStatement *stmt, int k);
+extern amplify_perturb_fn amplify_perturb;
+
+/* Report throughput for the last interval and ramp up. */
+void amplify_stats(uint64_t source, uint64_t sent, double seconds);
+
+#endif
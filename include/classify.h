@@ -0,0 +1,26 @@
+#ifndef CLASSIFY_H
+#define CLASSIFY_H
+
+/*
+ * Read/write classification of a query, looking at its text only.
+ *
+ * Reads are SELECT (and WITH, SHOW, VALUES, TABLE, EXPLAIN) without
+ * locking clauses, data-modifying CTEs or nextval(). Everything else,
+ * DDL included, is a write.
+ */
+enum StatementKind {
+  KIND_READ,
+  KIND_WRITE,
+};
+
+#include <stdint.h>
+
+enum StatementKind classify(const char *query);
+
+/*
+ * Same, remembering the answer per query fingerprint.
+ * Safe to call from several threads.
+ */
+enum StatementKind classify_cached(uint64_t fingerprint, const char *query);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef CLIENTSET_H
+#define CLIENTSET_H
+
+#include <stdint.h>
+
+/*
+ * Fixed size set of client ids, for per-client state that must not grow
+ * without bound. Not thread safe.
+ */
+#define CLIENT_SET_SIZE 4096 /* Power of 2 */
+
+struct ClientSet {
+  uint64_t slots[CLIENT_SET_SIZE]; /* client id + 1, 0 is free */
+  int len;
+};
+
+/* 1 if the client is in the set. */
+int clientset_has(struct ClientSet *set, uint32_t client_id);
+
+/* Returns 0 if the set is full. */
+int clientset_add(struct ClientSet *set, uint32_t client_id);
+
+void clientset_remove(struct ClientSet *set, uint32_t client_id);
+
+void clientset_clear(struct ClientSet *set);
+
+#endif
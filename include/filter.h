@@ -0,0 +1,29 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+
+/*
+ * Traffic filters, applied to the raw packet before anything is allocated.
+ *
+ * FILTER_SAMPLE:   keep this percentage of clients, picked by hashing client ids,
+ *                  so the same clients are kept every time.
+ * FILTER_PREFIX:   keep queries starting with one of these, e.g. "SELECT,UPDATE".
+ * FILTER_KEYWORDS: keep queries containing one of these, e.g. "users,orders".
+ * FILTER_KIND:     keep only "read" or "write" queries.
+ *
+ * Matching is case-insensitive.
+ */
+int filter_init(void);
+
+/* Should we replay packets of this client? */
+int filter_client(uint32_t client_id);
+
+/* Should we replay this query? */
+int filter_query(const char *query);
+
+void filter_stats(void);
+
+void filter_free(void);
+
+#endif
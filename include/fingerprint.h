@@ -0,0 +1,26 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Query shape fingerprint.
+ *
+ * Literals, numbers and $n placeholders are all treated as the same
+ * placeholder, whitespace is collapsed and keywords are case-insensitive,
+ * so "SELECT * FROM users WHERE id = 5" and "select * from users where id = $1"
+ * have the same fingerprint. Like on the server, the sign of a negative
+ * number is part of it: "id = -5" is "id = $1" too, "a - 5" is "a - $1".
+ */
+uint64_t fingerprint(const char *query);
+
+/*
+ * FNV-1a, also used to hash result rows.
+ */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len);
+
+#endif
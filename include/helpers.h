@@ -32,6 +32,16 @@ uint32_t parse_uint32(char *data);
  */
 uint16_t parse_uint16(char *data);
 
+/*
+ * Monotonic clock, in microseconds.
+ */
+uint64_t now_usec(void);
+
+/*
+ * Spread client ids evenly, for sampling and partitioning.
+ */
+uint32_t client_hash(uint32_t client_id);
+
 /* Log */
 void log_info(const char *fmt, ...);
 
@@ -0,0 +1,37 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#include <stdint.h>
+
+#include "statement.h"
+
+/*
+ * In-flight budget: statements handed to the pool but not finished yet.
+ *
+ * MAX_IN_FLIGHT and MAX_IN_FLIGHT_BYTES set the budget, 0 or unset
+ * means no limit. It's never exceeded, except for the bytes of the last
+ * statement admitted. OVERLOAD_POLICY decides what happens when it's exceeded:
+ *
+ *   block:        the parser waits for the workers to catch up (default),
+ *   sample:       keep only 1 in OVERLOAD_SAMPLE statements (default 10),
+ *                 the ones kept wait for room like with block,
+ *   drop-client:  drop every statement of the client for the rest of the
+ *                 packet log segment, so replayed clients stay consistent.
+ */
+int inflight_init(void);
+
+/* Should stmt be dispatched? Blocks with the block policy. */
+int inflight_admit(struct PStatement *stmt);
+
+/* A statement of this size is done. */
+void inflight_done(uint32_t size);
+
+/* Statements in flight right now. */
+uint64_t inflight_count(void);
+
+/* Segment finished, dropped clients get another chance. */
+void inflight_segment_end(void);
+
+void inflight_stats(void);
+
+#endif
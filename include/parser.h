@@ -0,0 +1,65 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "statement.h"
+#include "clientset.h"
+
+/*
+ * Separator between packets.
+ */
+#define DELIMETER '\x19' /* EM */
+#define LIST_SIZE 4096
+
+struct Parser;
+
+/* Called for every statement ready to execute, takes ownership of stmt. */
+typedef void (*parser_exec_fn)(struct Parser *parser, struct PStatement *stmt);
+
+/*
+ * Packet log parser.
+ *
+ * Several parsers can parse the same segment in parallel, see parser_run_all():
+ * each one indexes a byte range of the segment, then parses the records of
+ * the clients that hash to its partition, from every range in order. The
+ * packets of a client are always parsed in order by the same parser.
+ */
+struct Parser {
+  int id, nparsers;           /* Partition of clients we own */
+  parser_exec_fn exec;
+  void *arg;                  /* For exec */
+
+  uint64_t seq;               /* Position of the next record in the packet log */
+
+  /* Prepared statements waiting for their B & E packets */
+  struct PStatement *list[LIST_SIZE];
+
+  /* Clients whose last P packet was filtered out, so we skip their B & E too */
+  struct ClientSet filtered;
+
+  /* Stats, see parser_reset() */
+  int sent, dropped, source, orphaned;
+};
+
+struct Parser *parser_init(int id, int nparsers, parser_exec_fn exec, void *arg);
+
+/* Parse one \x19-terminated record. */
+void parser_record(struct Parser *parser, char *line, ssize_t nread);
+
+/*
+ * Parse a whole packet log segment. Returns 1 if it couldn't be opened,
+ * -1 if it couldn't be read in full, the records before are parsed.
+ */
+int parser_run(struct Parser *parser, const char *fn);
+
+/* Same with several parsers, each one on its own thread. */
+int parser_run_all(struct Parser **parsers, int nparsers, const char *fn);
+
+/* Reset the stats. */
+void parser_reset(struct Parser *parser);
+
+void parser_free(struct Parser *parser);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef PGSTAT_H
+#define PGSTAT_H
+
+#include <stdint.h>
+
+/*
+ * Server side statistics of the replay.
+ *
+ * When SERVER_STATS_URL is set, pg_stat_statements, pg_stat_database and
+ * pg_stat_bgwriter are snapshotted over that connection at every statistics
+ * interval, on a thread of its own. The differences between snapshots are logged, and the
+ * pg_stat_statements timings are joined by query fingerprint with what the
+ * workers of the first target's primary measured, which separates the time
+ * spent waiting in our queue and on the network from the execution time.
+ */
+int pgstat_init(void);
+
+/* Is the collector on? */
+int pgstat_enabled(void);
+
+/* A worker executed a statement, times in microseconds. Thread safe. */
+void pgstat_record(uint64_t fingerprint, uint64_t queue_usec, uint64_t latency_usec);
+
+/* Ask for a snapshot, the differences with the last one are logged in the background. */
+void pgstat_snapshot(void);
+
+void pgstat_free(void);
+
+#endif
@@ -1,7 +1,7 @@
 /*
  * Postgres pooler.
  */
-int postgres_init(void);
+int postgres_init(int scale);
 void postgres_assign(struct PStatement*);
 void postgres_free(void);
 void postgres_stats(void);
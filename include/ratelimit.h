@@ -0,0 +1,30 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include "statement.h"
+
+/*
+ * Token bucket rate limits, in statements per second.
+ *
+ * RATE_LIMIT caps all statements, RATE_LIMIT_READ and RATE_LIMIT_WRITE
+ * cap each kind of statement; 0 or unset means no limit. Statements wait
+ * for their turn, so the pace is held no matter how fast we parse.
+ *
+ * Limits can change without restarting:
+ *
+ *   SIGUSR1:  raise every limit by RATE_LIMIT_STEP percent (default 10),
+ *   SIGUSR2:  lower every limit by the same,
+ *   SIGHUP:   read RATE_LIMIT_FILE again, lines of "global|read|write <rate>".
+ */
+int ratelimit_init(void);
+
+/* Wait until stmt can be sent. Thread safe. */
+void ratelimit_wait(struct PStatement *stmt);
+
+/* stmt was sent after waiting, count it in the achieved rates. Thread safe. */
+void ratelimit_admitted(struct PStatement *stmt);
+
+/* Log the achieved and configured rates, then reset. */
+void ratelimit_stats(void);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef RESULTS_H
+#define RESULTS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * Per statement result recording, see RESULTS_FILE.
+ *
+ * The file starts with RESULTS_MAGIC followed by fixed size records
+ * in the order the statements finished.
+ */
+#define RESULTS_MAGIC "PGRRES01"
+#define RESULTS_MAGIC_LEN 8
+
+enum ResultOutcome {
+  OUTCOME_OK = 0,
+  OUTCOME_ERROR = 1,
+  OUTCOME_TIMEOUT = 2, /* Canceled after STATEMENT_TIMEOUT */
+};
+
+struct ResultRecord {
+  uint64_t seq;           /* Position of the statement in the packet log */
+  uint64_t fingerprint;   /* Query shape, see fingerprint() */
+  uint64_t hash;          /* Order-insensitive hash of the rows returned, added up row by row as they arrive */
+  uint32_t latency;       /* In microseconds */
+  uint32_t rows;
+  char sqlstate[5];       /* "00000" when OK */
+  uint8_t outcome;        /* enum ResultOutcome */
+  uint8_t reserved[2];
+};
+
+struct ResultWriter {
+  FILE *f;
+  pthread_mutex_t lock;
+};
+
+struct ResultWriter *results_open(const char *fn);
+void results_write(struct ResultWriter *writer, struct ResultRecord *record);
+void results_close(struct ResultWriter *writer);
+
+/* Read a whole result file, returns the number of records or -1. */
+ssize_t results_load(const char *fn, struct ResultRecord **records);
+
+#endif
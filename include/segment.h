@@ -0,0 +1,52 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Packet log segment reader.
+ *
+ * Segments compressed with zstd or LZ4 (frame format) are detected by their
+ * magic bytes and decompressed on a separate thread while we parse, the
+ * parser reads the decompressed stream like any other file.
+ */
+#define ZSTD_MAGIC 0xFD2FB528
+#define LZ4_MAGIC 0x184D2204
+
+enum SegmentFormat {
+  SEGMENT_RAW,
+  SEGMENT_ZSTD,
+  SEGMENT_LZ4,
+};
+
+struct Segment {
+  enum SegmentFormat format;
+  FILE *raw; /* The file on disk */
+  FILE *f;   /* What to read from */
+  pthread_t thread;
+  int pipes[2];
+  uint64_t compressed, decompressed, usec; /* Decompression stats */
+  int failed;
+};
+
+/* Open a segment, NULL if we can't read it. */
+FILE *segment_open(struct Segment *segment, const char *fn);
+
+/* Close a segment and add its stats to the totals, -1 if it couldn't be read in full. */
+int segment_close(struct Segment *segment);
+
+/* Which formats were we built with? */
+int segment_supported(enum SegmentFormat format);
+
+/* Detect the format of an open file, leaves it at the beginning. */
+enum SegmentFormat segment_format(FILE *f);
+
+/* "raw", "zstd" or "lz4" */
+const char *segment_format_name(enum SegmentFormat format);
+
+/* Log the compression ratio, decompression throughput and failed segments, then reset. */
+void segment_stats(void);
+
+#endif
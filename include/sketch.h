@@ -0,0 +1,92 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+
+/*
+ * Fixed memory summaries of a stream, for looking at packet logs
+ * bigger than what we could keep in memory. Not thread safe.
+ */
+
+/*
+ * HyperLogLog distinct counter, 2^p one byte registers.
+ * Standard error is about 1.04 / sqrt(2^p).
+ */
+struct Hll {
+  int p;
+  uint8_t *registers;
+};
+
+void hll_init(struct Hll *hll, int p);
+void hll_add(struct Hll *hll, uint64_t hash);
+double hll_estimate(struct Hll *hll);
+void hll_clear(struct Hll *hll);
+void hll_free(struct Hll *hll);
+
+/*
+ * Count-min sketch, never underestimates. With width w and depth d,
+ * estimates are within 2N/w of the truth with probability 1 - 2^-d.
+ */
+#define CM_DEPTH 4
+#define CM_WIDTH 65536 /* Power of 2 */
+
+struct CountMin {
+  uint32_t *counters; /* CM_DEPTH rows of CM_WIDTH */
+};
+
+void countmin_init(struct CountMin *cm);
+/* Add one occurrence, returns the new estimate. */
+uint32_t countmin_add(struct CountMin *cm, uint64_t hash);
+void countmin_free(struct CountMin *cm);
+
+/*
+ * The K heaviest keys by count-min estimate, as a min-heap.
+ */
+#define TOPK_SIZE 64
+#define TOPK_SAMPLE 256 /* Bytes of the first query text we keep */
+
+struct TopKEntry {
+  uint64_t key;
+  uint32_t count;
+  int kind;
+  char sample[TOPK_SAMPLE];
+};
+
+struct TopK {
+  struct TopKEntry heap[TOPK_SIZE];
+  int len;
+};
+
+/* Offer a key with its current count, sample is kept when it enters the top K. */
+void topk_offer(struct TopK *topk, uint64_t key, uint32_t count, int kind, const char *sample);
+
+/* Sort the entries, heaviest first. Destroys the heap. */
+void topk_sort(struct TopK *topk);
+
+/*
+ * Log-linear histogram: powers of two, each split in HIST_SUB buckets,
+ * so percentiles are within 25%.
+ */
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct Histogram {
+  uint64_t buckets[HIST_BUCKETS];
+  uint64_t count, sum, min, max;
+};
+
+void histogram_add(struct Histogram *hist, uint64_t value);
+/* Upper bound of the bucket holding the q quantile, 0 <= q <= 1. */
+uint64_t histogram_quantile(struct Histogram *hist, double q);
+/* Bucket the value falls in. */
+int histogram_bucket(uint64_t value);
+/* Largest value that falls in the bucket. */
+uint64_t histogram_bucket_max(int bucket);
+
+/*
+ * 64-bit hash of an integer, for the sketches.
+ */
+uint64_t sketch_hash(uint64_t value);
+
+#endif
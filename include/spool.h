@@ -0,0 +1,44 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Packet log rotation and partitioning.
+ *
+ * PARTITION=k/K runs this replayer as instance k (0-based) out of K,
+ * each instance replays only the clients that hash to it. Whichever
+ * instance gets the lock rotates the packet log for everyone, leaving
+ * one hard link per instance: <fn>.<seq>.p<k>. Each instance replays
+ * and removes its own links, oldest first, and the disk space is freed
+ * when the last instance is done with a segment.
+ */
+int spool_init(void);
+
+/*
+ * Name of the next segment to replay in segment, rotating if needed.
+ * Returns 1 if there is nothing to replay. The caller removes the
+ * segment once it's done with it.
+ */
+int spool_next(char *segment, size_t len, const char *fn);
+
+/* Does this instance replay this client? */
+int spool_owns(uint32_t client_id);
+
+/*
+ * Hash clients are partitioned by. The high bits of client_hash(), so it's
+ * independent of the client_hash() % 100 that FILTER_SAMPLE keeps.
+ */
+uint32_t spool_hash(uint32_t client_id);
+
+/* Number of instances, K. */
+int spool_partitions(void);
+
+/*
+ * Publish this instance's running totals; instance 0 logs
+ * the totals of all instances.
+ */
+void spool_stats(const char *fn, uint64_t sent, uint64_t dropped);
+
+#endif
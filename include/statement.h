@@ -2,19 +2,31 @@
  * Prepared statement.
  */
 
+#ifndef STATEMENT_H
+#define STATEMENT_H
+
 #include <stdint.h>
 
 #include "parameter.h"
 
 struct PStatement {
 	uint32_t client_id;
+	uint64_t seq; /* Position in the packet log, stable between runs */
+	uint64_t fingerprint; /* Query shape */
 	char *query;
 	struct Parameter **params;
 	uint16_t np;
 	uint16_t sp;
+	uint32_t size; /* Bytes allocated for this statement */
+	uint64_t queued; /* When it was handed to the pools, monotonic microseconds */
+	int refs; /* Workers still holding this statement, see pstatement_release() */
 };
 
 struct PStatement *pstatement_init(char *query, uint32_t client_id);
 void pstatement_add_param(struct PStatement *stmt, struct Parameter *param);
 void pstatement_debug(struct PStatement *stmt);
+struct PStatement *pstatement_clone(struct PStatement *stmt);
 void pstatement_free(struct PStatement *stmt);
+int pstatement_release(struct PStatement *stmt);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef TIMEOUTS_H
+#define TIMEOUTS_H
+
+#include <stdint.h>
+
+/*
+ * Statement deadlines.
+ *
+ * STATEMENT_TIMEOUT is the default, in milliseconds.
+ * STATEMENT_TIMEOUT_FILE overrides it per query shape, one
+ * "<fingerprint in hex> <milliseconds>" per line.
+ */
+int timeouts_init(void);
+
+/* Timeout for this query shape in milliseconds, 0 if none. */
+uint32_t timeout_for(uint64_t fingerprint);
+
+/* Is any timeout configured? */
+int timeouts_enabled(void);
+
+void timeouts_free(void);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ * Traffic amplification.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "amplify.h"
+#include "parameter.h"
+#include "helpers.h"
+
+#define MAX_KEY_PARAMS 64
+#define CLIENT_MIX 0x9E3779B1u /* Golden ratio, spreads virtual client ids */
+#define KNEE 0.1 /* Less than 10% more throughput for one more client */
+
+static int max_factor = 1, factor = 1, ramp = 0;
+static int64_t key_offset = 0;
+static int key_params[MAX_KEY_PARAMS] = { 0 }; /* 1 if the parameter is a key */
+static int key_params_set = 0;
+
+/* Best throughput seen while ramping, and at which multiplier */
+static double best_rate = 0;
+static int best_factor = 0, knee_reported = 0;
+
+static void perturb_keys(struct PStatement *stmt, int k);
+
+amplify_perturb_fn amplify_perturb = perturb_keys;
+
+int amplify_init(void) {
+  char *env;
+
+  if ((env = getenv("AMPLIFY")) != NULL && atoi(env) > 1)
+    max_factor = atoi(env);
+
+  if ((env = getenv("AMPLIFY_RAMP")) != NULL)
+    ramp = atoi(env);
+
+  if ((env = getenv("AMPLIFY_KEY_OFFSET")) != NULL)
+    key_offset = strtoll(env, NULL, 10);
+
+  if ((env = getenv("AMPLIFY_KEY_PARAMS")) != NULL) {
+    char *params = strdup(env), *param, *saveptr = NULL;
+
+    for (param = strtok_r(params, ",", &saveptr); param != NULL; param = strtok_r(NULL, ",", &saveptr)) {
+      int i = atoi(param);
+
+      if (i < 1 || i > MAX_KEY_PARAMS) {
+        log_info("[Amplify] Parameter %s out of range, max is %d", param, MAX_KEY_PARAMS);
+        free(params);
+        return -1;
+      }
+
+      key_params[i - 1] = 1;
+      key_params_set = 1;
+    }
+
+    free(params);
+  }
+
+  factor = ramp ? 1 : max_factor;
+
+  if (max_factor > 1)
+    log_info("[Amplify] Replaying every client as %d virtual clients%s", max_factor, ramp ? ", ramping up" : "");
+
+  return 0;
+}
+
+int amplify_max(void) {
+  return max_factor;
+}
+
+int amplify_current(void) {
+  return factor;
+}
+
+/*
+ * Add k * AMPLIFY_KEY_OFFSET to integer parameters.
+ */
+static void perturb_keys(struct PStatement *stmt, int k) {
+  int i;
+
+  if (key_offset == 0)
+    return;
+
+  for (i = 0; i < stmt->np; i++) {
+    struct Parameter *param = stmt->params[i];
+    char *end, buf[24];
+    long long value;
+
+    if (key_params_set && (i >= MAX_KEY_PARAMS || !key_params[i]))
+      continue;
+
+    if (param->len <= 0 || param->len > 19)
+      continue;
+
+    value = strtoll(param->value, &end, 10);
+
+    /* Not an integer */
+    if (*end != '\0')
+      continue;
+
+    int len = snprintf(buf, sizeof(buf), "%lld", value + key_offset * k);
+
+    free(param->value);
+    param->value = malloc(len + 1);
+    memcpy(param->value, buf, len + 1);
+    stmt->size += len - param->len;
+    param->len = len;
+  }
+}
+
+struct PStatement *amplify_clone(struct PStatement *stmt, int k) {
+  struct PStatement *copy = pstatement_clone(stmt);
+
+  copy->client_id = stmt->client_id + k * CLIENT_MIX;
+  amplify_perturb(copy, k);
+
+  return copy;
+}
+
+/*
+ * Report the achieved multiplier and throughput, ramp up one step.
+ */
+void amplify_stats(uint64_t source, uint64_t sent, double seconds) {
+  double rate = seconds > 0 ? sent / seconds : 0;
+
+  if (max_factor == 1)
+    return;
+
+  log_info("[Amplify][Statistics] Multiplier: %d configured, %.2f achieved; %.0f statements/second",
+    factor, source > 0 ? (double)sent / source : 0, rate);
+
+  if (!ramp)
+    return;
+
+  if (rate > best_rate * (1 + KNEE)) {
+    best_rate = rate;
+    best_factor = factor;
+  }
+  else if (!knee_reported) {
+    log_info("[Amplify] Throughput stopped scaling at %dx, %.0f statements/second", best_factor, best_rate);
+    knee_reported = 1;
+  }
+
+  if (factor < max_factor)
+    factor++;
+}
@@ -0,0 +1,358 @@
+/*
+ * Describe what's in a packet log before replaying it.
+ *
+ * Usage: analyze <packet log> [window]
+ *
+ * One pass in fixed memory, so it works on logs of any size, compressed
+ * or not. Prints a JSON report: the statement mix, distinct clients and
+ * query shapes (HyperLogLog), the heaviest shapes (count-min and a top K),
+ * histograms of query sizes, parameter counts and sizes, how many records
+ * pass between two statements of a client and how many clients are in
+ * the middle of an extended protocol statement (concurrency).
+ *
+ * The packet log has no timestamps, so time is the position in the log:
+ * distinct clients are also counted per window of records (default 10000).
+ * Only the last MAX_WINDOWS windows are kept, all of the same size.
+ * Shapes are counted when they're sent (Q and P packets).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "replayer.h"
+#include "helpers.h"
+#include "parser.h"
+#include "segment.h"
+#include "fingerprint.h"
+#include "classify.h"
+#include "sketch.h"
+
+int DEBUG = 0;
+
+#define CLIENTS_SIZE 65536 /* Power of 2 */
+#define MAX_WINDOWS 512
+
+/*
+ * What we remember about a client. Direct mapped, a client
+ * colliding with another one replaces it.
+ */
+struct ClientSlot {
+  uint64_t key; /* client id + 1, 0 is free */
+  uint64_t last; /* Record of its last statement */
+  int open; /* P seen, E not yet */
+};
+
+static struct ClientSlot clients[CLIENTS_SIZE];
+static uint64_t open_clients = 0;
+
+/* Distinct clients of the last MAX_WINDOWS windows, oldest first from windows_start */
+static uint64_t windows[MAX_WINDOWS];
+static uint64_t nwindows = 0; /* Ever ended */
+static uint64_t window_size = 10000;
+
+static struct Hll distinct_clients, distinct_shapes, window_clients;
+static struct CountMin shape_counts;
+static struct TopK top_shapes;
+static struct Histogram query_size, param_count, param_size, client_gap, concurrency;
+
+static uint64_t records = 0, bytes = 0, tags[256];
+static uint64_t statements = 0, simple = 0, extended = 0, reads = 0, writes = 0, corrupt = 0;
+
+static struct ClientSlot *client_slot(uint32_t client_id) {
+  struct ClientSlot *slot = &clients[client_hash(client_id) & (CLIENTS_SIZE - 1)];
+
+  if (slot->key != (uint64_t)client_id + 1) {
+    if (slot->open)
+      open_clients--;
+
+    slot->key = (uint64_t)client_id + 1;
+    slot->last = 0;
+    slot->open = 0;
+  }
+
+  return slot;
+}
+
+static void window_end(void) {
+  /* Overwrites the oldest one when full */
+  windows[nwindows++ % MAX_WINDOWS] = (uint64_t)(hll_estimate(&window_clients) + 0.5);
+  hll_clear(&window_clients);
+}
+
+static void shape(const char *query) {
+  uint64_t fp = fingerprint(query);
+  enum StatementKind kind = classify_cached(fp, query);
+
+  if (kind == KIND_READ)
+    reads++;
+  else
+    writes++;
+
+  histogram_add(&query_size, strlen(query));
+  hll_add(&distinct_shapes, sketch_hash(fp));
+  topk_offer(&top_shapes, fp, countmin_add(&shape_counts, sketch_hash(fp)), kind, query);
+}
+
+static void statement(struct ClientSlot *slot) {
+  statements++;
+
+  if (slot->last)
+    histogram_add(&client_gap, records - slot->last);
+
+  slot->last = records;
+}
+
+/*
+ * Parameters of a B packet, without copying them.
+ */
+static void bind(char *it, char *end) {
+  uint16_t nf, np, i;
+
+  it += strnlen(it, end - it) + 1; /* Portal */
+  if (it >= end)
+    goto corrupt;
+  it += strnlen(it, end - it) + 1; /* Statement */
+
+  if (it + 2 > end)
+    goto corrupt;
+  nf = parse_uint16(it);
+  it += 2 + 2 * nf;
+
+  if (it + 2 > end)
+    goto corrupt;
+  np = parse_uint16(it);
+  it += 2;
+
+  histogram_add(&param_count, np);
+
+  for (i = 0; i < np; i++) {
+    int32_t plen;
+
+    if (it + 4 > end)
+      goto corrupt;
+
+    plen = (int32_t)parse_uint32(it);
+    it += 4;
+
+    /* NULL */
+    if (plen < 0)
+      plen = 0;
+
+    histogram_add(&param_size, plen);
+    it += plen;
+  }
+
+  return;
+
+corrupt:
+  corrupt++;
+}
+
+static void record(char *line, ssize_t nread) {
+  char *it = line, *end = line + nread;
+  struct ClientSlot *slot;
+  uint32_t client_id;
+  char tag;
+
+  records++;
+  bytes += nread;
+
+  /* Client id, tag and length */
+  if (nread < 9 + 1) {
+    corrupt++;
+    return;
+  }
+
+  client_id = parse_uint32(it);
+  tag = it[4];
+  it += 9;
+
+  /* Terminate the message, instead of the delimiter */
+  if (line[nread - 1] == DELIMETER) {
+    line[nread - 1] = '\0';
+    end--;
+  }
+
+  tags[(unsigned char)tag]++;
+  hll_add(&distinct_clients, sketch_hash(client_id));
+  hll_add(&window_clients, sketch_hash(client_id));
+  slot = client_slot(client_id);
+
+  switch (tag) {
+    case 'Q':
+      simple++;
+      statement(slot);
+      shape(it);
+      break;
+
+    case 'P':
+      if (!slot->open) {
+        slot->open = 1;
+        open_clients++;
+      }
+      it += strnlen(it, end - it) + 1; /* Statement name */
+      if (it < end)
+        shape(it);
+      else
+        corrupt++;
+      break;
+
+    case 'B':
+      bind(it, end);
+      break;
+
+    case 'E':
+      extended++;
+      statement(slot);
+      if (slot->open) {
+        slot->open = 0;
+        open_clients--;
+      }
+      break;
+
+    default:
+      corrupt++;
+  }
+
+  histogram_add(&concurrency, open_clients);
+
+  if (records % window_size == 0)
+    window_end();
+}
+
+static void print_string(const char *s) {
+  putchar('"');
+
+  for (; *s; s++) {
+    unsigned char c = *s;
+
+    if (c == '"' || c == '\\')
+      printf("\\%c", c);
+    else if (c < 0x20)
+      printf("\\u%04x", c);
+    else
+      putchar(c);
+  }
+
+  putchar('"');
+}
+
+static void print_histogram(const char *name, struct Histogram *hist, int last) {
+  int i, first = 1;
+
+  printf("    \"%s\": {\"count\": %llu, \"min\": %llu, \"max\": %llu, \"mean\": %.2f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"buckets\": [",
+    name, (unsigned long long)hist->count, (unsigned long long)hist->min, (unsigned long long)hist->max,
+    hist->count ? (double)hist->sum / hist->count : 0,
+    (unsigned long long)histogram_quantile(hist, 0.5), (unsigned long long)histogram_quantile(hist, 0.9),
+    (unsigned long long)histogram_quantile(hist, 0.99));
+
+  /* Non-empty buckets, as [upper bound, count] */
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    if (hist->buckets[i] == 0)
+      continue;
+
+    printf("%s[%llu, %llu]", first ? "" : ", ", (unsigned long long)histogram_bucket_max(i), (unsigned long long)hist->buckets[i]);
+    first = 0;
+  }
+
+  printf("]}%s\n", last ? "" : ",");
+}
+
+static void report(double seconds) {
+  uint64_t w, kept;
+  int i;
+
+  topk_sort(&top_shapes);
+
+  printf("{\n");
+  printf("  \"records\": %llu,\n  \"bytes\": %llu,\n  \"corrupt\": %llu,\n  \"seconds\": %.3f,\n  \"mb_per_sec\": %.1f,\n",
+    (unsigned long long)records, (unsigned long long)bytes, (unsigned long long)corrupt, seconds,
+    seconds > 0 ? bytes / seconds / 1e6 : 0);
+  printf("  \"packets\": {\"Q\": %llu, \"P\": %llu, \"B\": %llu, \"E\": %llu},\n",
+    (unsigned long long)tags['Q'], (unsigned long long)tags['P'], (unsigned long long)tags['B'], (unsigned long long)tags['E']);
+  printf("  \"statements\": {\"total\": %llu, \"simple\": %llu, \"extended\": %llu, \"reads\": %llu, \"writes\": %llu},\n",
+    (unsigned long long)statements, (unsigned long long)simple, (unsigned long long)extended,
+    (unsigned long long)reads, (unsigned long long)writes);
+  printf("  \"distinct_clients\": %.0f,\n", hll_estimate(&distinct_clients));
+
+  /* The last window can be shorter */
+  kept = nwindows < MAX_WINDOWS ? nwindows : MAX_WINDOWS;
+  printf("  \"windows\": {\"records\": %llu, \"first_record\": %llu, \"last_records\": %llu, \"distinct_clients\": [",
+    (unsigned long long)window_size, (unsigned long long)((nwindows - kept) * window_size),
+    (unsigned long long)(records % window_size ? records % window_size : window_size));
+  for (w = nwindows - kept; w < nwindows; w++)
+    printf("%s%llu", w > nwindows - kept ? ", " : "", (unsigned long long)windows[w % MAX_WINDOWS]);
+  printf("]},\n");
+
+  printf("  \"shapes\": {\"distinct\": %.0f, \"top\": [\n", hll_estimate(&distinct_shapes));
+  for (i = 0; i < top_shapes.len; i++) {
+    struct TopKEntry *entry = &top_shapes.heap[i];
+
+    printf("    {\"fingerprint\": \"%016llx\", \"count\": %u, \"share\": %.4f, \"kind\": \"%s\", \"query\": ",
+      (unsigned long long)entry->key, entry->count,
+      tags['Q'] + tags['P'] ? (double)entry->count / (tags['Q'] + tags['P']) : 0,
+      entry->kind == KIND_READ ? "read" : "write");
+    print_string(entry->sample);
+    printf("}%s\n", i < top_shapes.len - 1 ? "," : "");
+  }
+  printf("  ]},\n");
+
+  printf("  \"histograms\": {\n");
+  print_histogram("query_size", &query_size, 0);
+  print_histogram("param_count", &param_count, 0);
+  print_histogram("param_size", &param_size, 0);
+  print_histogram("client_gap", &client_gap, 0);
+  print_histogram("concurrency", &concurrency, 1);
+  printf("  }\n}\n");
+}
+
+int main(int argc, char **argv) {
+  struct Segment segment;
+  FILE *f;
+  char *line = NULL;
+  size_t line_len = 0;
+  ssize_t nread;
+  uint64_t start;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <packet log> [window]\n", argv[0]);
+    return 2;
+  }
+
+  if (argc > 2 && atoll(argv[2]) > 0)
+    window_size = atoll(argv[2]);
+
+  if ((f = segment_open(&segment, argv[1])) == NULL) {
+    fprintf(stderr, "Could not read %s\n", argv[1]);
+    return 1;
+  }
+
+  hll_init(&distinct_clients, 14);
+  hll_init(&distinct_shapes, 14);
+  hll_init(&window_clients, 10);
+  countmin_init(&shape_counts);
+
+  start = now_usec();
+
+  while ((nread = getdelim(&line, &line_len, DELIMETER, f)) > 0)
+    record(line, nread);
+
+  /* Partial last window */
+  if (records % window_size != 0)
+    window_end();
+
+  report((double)(now_usec() - start) / SECOND);
+
+  segment_close(&segment);
+  free(line);
+  hll_free(&distinct_clients);
+  hll_free(&distinct_shapes);
+  hll_free(&window_clients);
+  countmin_free(&shape_counts);
+
+  return 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * Benchmark the hot path on a packet log, e.g. one made by pktgen.
+ *
+ * Usage: benchmark <packet log> [iterations]
+ *
+ * Prints one JSON object per benchmark:
+ *
+ *   parse:        parsing only, statements are freed right away,
+ *   parse_threads_N: the same with N parser threads (1, 2, 4 and 8),
+ *                 like PARSER_THREADS,
+ *   allocations:  heap allocations per statement while parsing,
+ *   dispatch:     parsing plus the in-flight accounting, routing and
+ *                 release the player does for every statement,
+ *   end_to_end:   replay against DATABASE_URL, if it's set, until every
+ *                 statement is done.
+ *
+ * Every object has the format of the packet log, run it on a compressed
+ * copy (see recompress) to compare with the raw one.
+ *
+ * Timed benchmarks keep the fastest of the iterations (default 5).
+ * Must be linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,
+ * see the bench target.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "replayer.h"
+#include "helpers.h"
+#include "statement.h"
+#include "parser.h"
+#include "postgres.h"
+#include "inflight.h"
+#include "classify.h"
+#include "filter.h"
+#include "spool.h"
+#include "segment.h"
+
+int DEBUG = 0;
+
+/* Allocation counters, see the --wrap linker flags */
+static uint64_t allocations = 0, allocated = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&allocated, size, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&allocated, nmemb * size, __ATOMIC_RELAXED);
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&allocated, size, __ATOMIC_RELAXED);
+  return __real_realloc(ptr, size);
+}
+
+#define MAX_BENCH_PARSERS 8
+
+struct Run {
+  uint64_t records, statements, usec;
+};
+
+static void exec_free(struct Parser *parser, struct PStatement *stmt) {
+  pstatement_free(stmt);
+  parser->sent++;
+}
+
+/*
+ * What main.c and the workers do for a statement, minus the network.
+ */
+static void exec_dispatch(struct Parser *parser, struct PStatement *stmt) {
+  uint32_t size = stmt->size;
+
+  if (!inflight_admit(stmt)) {
+    pstatement_free(stmt);
+    parser->dropped++;
+    return;
+  }
+
+  classify_cached(stmt->fingerprint, stmt->query);
+  parser->sent++;
+
+  if (pstatement_release(stmt))
+    inflight_done(size);
+}
+
+static void exec_replay(struct Parser *parser, struct PStatement *stmt) {
+  if (!inflight_admit(stmt)) {
+    pstatement_free(stmt);
+    parser->dropped++;
+    return;
+  }
+
+  postgres_assign(stmt);
+  parser->sent++;
+}
+
+static struct Run run(const char *fn, parser_exec_fn exec) {
+  struct Parser *parser = parser_init(0, 1, exec, NULL);
+  struct Run result;
+  uint64_t start = now_usec();
+
+  parser_run(parser, fn);
+
+  /* Replaying: wait for the workers */
+  while (inflight_count() > 0)
+    usleep(1000);
+
+  result.usec = now_usec() - start;
+  result.records = parser->seq;
+  result.statements = parser->sent;
+
+  parser_free(parser);
+  return result;
+}
+
+static struct Run run_threads(const char *fn, parser_exec_fn exec, int nparsers) {
+  struct Parser *parsers[MAX_BENCH_PARSERS];
+  struct Run result;
+  uint64_t start;
+  int i;
+
+  for (i = 0; i < nparsers; i++)
+    parsers[i] = parser_init(i, nparsers, exec, NULL);
+
+  start = now_usec();
+  parser_run_all(parsers, nparsers, fn);
+
+  result.usec = now_usec() - start;
+  result.records = parsers[0]->seq;
+  result.statements = 0;
+
+  for (i = 0; i < nparsers; i++) {
+    result.statements += parsers[i]->sent;
+    parser_free(parsers[i]);
+  }
+
+  return result;
+}
+
+static struct Run fastest(const char *fn, parser_exec_fn exec, int nparsers, int iterations) {
+  struct Run best, current;
+  int i;
+
+  best = nparsers > 0 ? run_threads(fn, exec, nparsers) : run(fn, exec);
+
+  for (i = 1; i < iterations; i++) {
+    current = nparsers > 0 ? run_threads(fn, exec, nparsers) : run(fn, exec);
+    if (current.usec < best.usec)
+      best = current;
+  }
+
+  return best;
+}
+
+static const char *format = "raw";
+
+static void report(const char *name, struct Run *result, uint64_t bytes) {
+  double seconds = (double)result->usec / SECOND;
+
+  printf("{\"benchmark\": \"%s\", \"format\": \"%s\", \"records\": %llu, \"statements\": %llu, \"bytes\": %llu, \"seconds\": %.6f, "
+    "\"statements_per_sec\": %.0f, \"mb_per_sec\": %.2f, \"ns_per_statement\": %.1f}\n",
+    name, format, (unsigned long long)result->records, (unsigned long long)result->statements, (unsigned long long)bytes, seconds,
+    seconds > 0 ? result->statements / seconds : 0,
+    seconds > 0 ? bytes / seconds / 1e6 : 0,
+    result->statements > 0 ? result->usec * 1e3 / result->statements : 0);
+}
+
+int main(int argc, char **argv) {
+  struct Run parse, threads, dispatch, replay, counted;
+  struct stat st;
+  uint64_t count_before, bytes_before;
+  int iterations = 5, nparsers;
+  const char *fn;
+  FILE *f;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <packet log> [iterations]\n", argv[0]);
+    return 2;
+  }
+
+  fn = argv[1];
+
+  if (argc > 2 && atoi(argv[2]) > 0)
+    iterations = atoi(argv[2]);
+
+  if (stat(fn, &st) != 0 || (f = fopen(fn, "r")) == NULL) {
+    fprintf(stderr, "Could not read %s\n", fn);
+    return 1;
+  }
+
+  format = segment_format_name(segment_format(f));
+  fclose(f);
+
+  if (inflight_init() || filter_init() || spool_init())
+    return 1;
+
+  parse = fastest(fn, exec_free, 0, iterations);
+  report("parse", &parse, st.st_size);
+
+  for (nparsers = 1; nparsers <= MAX_BENCH_PARSERS; nparsers *= 2) {
+    char name[32];
+
+    threads = fastest(fn, exec_free, nparsers, iterations);
+    snprintf(name, sizeof(name), "parse_threads_%d", nparsers);
+    report(name, &threads, st.st_size);
+  }
+
+  count_before = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+  bytes_before = __atomic_load_n(&allocated, __ATOMIC_RELAXED);
+  counted = run(fn, exec_free);
+  count_before = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - count_before;
+  bytes_before = __atomic_load_n(&allocated, __ATOMIC_RELAXED) - bytes_before;
+
+  printf("{\"benchmark\": \"allocations\", \"format\": \"%s\", \"statements\": %llu, \"allocations\": %llu, \"bytes\": %llu, "
+    "\"allocations_per_statement\": %.2f, \"bytes_per_statement\": %.1f}\n",
+    format, (unsigned long long)counted.statements, (unsigned long long)count_before, (unsigned long long)bytes_before,
+    counted.statements > 0 ? (double)count_before / counted.statements : 0,
+    counted.statements > 0 ? (double)bytes_before / counted.statements : 0);
+
+  dispatch = fastest(fn, exec_dispatch, 0, iterations);
+  report("dispatch", &dispatch, st.st_size);
+
+  printf("{\"benchmark\": \"dispatch_overhead\", \"format\": \"%s\", \"ns_per_statement\": %.1f}\n",
+    format, dispatch.statements > 0 ? ((double)dispatch.usec - parse.usec) * 1e3 / dispatch.statements : 0);
+
+  if (getenv("DATABASE_URL") != NULL) {
+    if (postgres_init(1))
+      return 1;
+
+    replay = run(fn, exec_replay);
+    report("end_to_end", &replay, st.st_size);
+
+    postgres_free();
+  }
+
+  filter_free();
+  return 0;
+}
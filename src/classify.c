@@ -0,0 +1,135 @@
+/*
+ * Read/write classification.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+
+#include "classify.h"
+
+/*
+ * Direct mapped, each slot is the fingerprint with the kind in the lowest bit,
+ * so it can be read and written atomically without a lock.
+ */
+#define CACHE_SIZE 8192 /* Power of 2 */
+static uint64_t cache[CACHE_SIZE] = { 0 };
+
+static const char *read_keywords[] = { "select", "with", "show", "values", "table", "explain", NULL };
+
+/* Any of these makes a read a write, a space stands for any whitespace */
+static const char *write_markers[] = {
+  "for update", "for no key update", "for share", "for key share",
+  "insert", "update", "delete", "nextval", "setval",
+  NULL,
+};
+
+/*
+ * Skip whitespace, comments and parentheses.
+ */
+static const char *skip_noise(const char *it) {
+  while (*it) {
+    if (isspace((unsigned char)*it) || *it == '(') {
+      it++;
+    }
+    else if (it[0] == '-' && it[1] == '-') {
+      while (*it && *it != '\n')
+        it++;
+    }
+    else if (it[0] == '/' && it[1] == '*') {
+      const char *end = strstr(it + 2, "*/");
+      it = end ? end + 2 : it + strlen(it);
+    }
+    else {
+      break;
+    }
+  }
+
+  return it;
+}
+
+static int is_word_char(char c) {
+  return isalnum((unsigned char)c) || c == '_';
+}
+
+/*
+ * Does it start with the lower case words? Returns where they end, or NULL.
+ */
+static const char *match_words(const char *it, const char *words) {
+  while (*words) {
+    if (*words == ' ') {
+      if (!isspace((unsigned char)*it))
+        return NULL;
+      while (isspace((unsigned char)*it))
+        it++;
+    }
+    else if (tolower((unsigned char)*it) == *words) {
+      it++;
+    }
+    else {
+      return NULL;
+    }
+
+    words++;
+  }
+
+  return it;
+}
+
+/*
+ * Case-insensitive search for whole words, last_update and update_count are not update.
+ */
+static int has_word(const char *query, const char *word) {
+  const char *it, *end;
+
+  for (it = query; *it; it++) {
+    if (it > query && is_word_char(it[-1]))
+      continue;
+
+    if ((end = match_words(it, word)) != NULL && !is_word_char(*end))
+      return 1;
+  }
+
+  return 0;
+}
+
+enum StatementKind classify(const char *query) {
+  const char *it = skip_noise(query);
+  int i, read = 0;
+
+  for (i = 0; read_keywords[i] != NULL; i++) {
+    size_t len = strlen(read_keywords[i]);
+
+    if (strncasecmp(it, read_keywords[i], len) == 0 && !is_word_char(it[len])) {
+      read = 1;
+      break;
+    }
+  }
+
+  if (!read)
+    return KIND_WRITE;
+
+  for (i = 0; write_markers[i] != NULL; i++) {
+    if (has_word(it, write_markers[i]))
+      return KIND_WRITE;
+  }
+
+  return KIND_READ;
+}
+
+enum StatementKind classify_cached(uint64_t fingerprint, const char *query) {
+  uint64_t key = fingerprint | 1; /* 0 is an empty slot */
+  size_t slot = (fingerprint >> 1) & (CACHE_SIZE - 1);
+  uint64_t entry = __atomic_load_n(&cache[slot], __ATOMIC_RELAXED);
+  enum StatementKind kind;
+
+  if (entry != 0 && (entry | 1) == key)
+    return (entry & 1) ? KIND_WRITE : KIND_READ;
+
+  kind = classify(query);
+  __atomic_store_n(&cache[slot], (key & ~1ULL) | (kind == KIND_WRITE), __ATOMIC_RELAXED);
+
+  return kind;
+}
@@ -0,0 +1,69 @@
+/*
+ * Fixed size set of client ids.
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "clientset.h"
+
+#define NEXT(i) (((i) + 1) & (CLIENT_SET_SIZE - 1))
+
+static size_t clientset_slot(struct ClientSet *set, uint32_t client_id) {
+  uint64_t key = (uint64_t)client_id + 1;
+  size_t i;
+
+  for (i = client_id & (CLIENT_SET_SIZE - 1); set->slots[i] != 0 && set->slots[i] != key; i = NEXT(i))
+    ;
+
+  return i;
+}
+
+int clientset_has(struct ClientSet *set, uint32_t client_id) {
+  if (set->len == 0)
+    return 0;
+
+  return set->slots[clientset_slot(set, client_id)] != 0;
+}
+
+int clientset_add(struct ClientSet *set, uint32_t client_id) {
+  size_t i = clientset_slot(set, client_id);
+
+  if (set->slots[i] != 0)
+    return 1;
+
+  /* Keep one slot free so lookups end */
+  if (set->len == CLIENT_SET_SIZE - 1)
+    return 0;
+
+  set->slots[i] = (uint64_t)client_id + 1;
+  set->len++;
+  return 1;
+}
+
+/*
+ * Remove and re-insert the rest of the cluster, so lookups don't stop early.
+ */
+void clientset_remove(struct ClientSet *set, uint32_t client_id) {
+  size_t i = clientset_slot(set, client_id), j;
+
+  if (set->slots[i] == 0)
+    return;
+
+  set->slots[i] = 0;
+  set->len--;
+
+  for (j = NEXT(i); set->slots[j] != 0; j = NEXT(j)) {
+    uint64_t key = set->slots[j];
+    set->slots[j] = 0;
+    set->len--;
+    clientset_add(set, (uint32_t)(key - 1));
+  }
+}
+
+void clientset_clear(struct ClientSet *set) {
+  if (set->len > 0) {
+    memset(set->slots, 0, sizeof(set->slots));
+    set->len = 0;
+  }
+}
@@ -0,0 +1,197 @@
+/*
+ * Compare the results of two replays, see RESULTS_FILE.
+ *
+ * Usage: compare <baseline> <candidate> [threshold]
+ *
+ * Statements are matched by their position in the packet log, so both runs
+ * must have replayed the same packet log. Reports, per query shape,
+ * latency regressions above threshold (default 0.2, i.e. 20% slower)
+ * and statements that returned different results.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "replayer.h"
+#include "helpers.h"
+#include "results.h"
+
+int DEBUG = 0;
+
+struct Shape {
+  uint64_t fingerprint;
+  uint64_t count;
+  uint64_t latency_a, latency_b;
+  uint64_t rows_mismatch, status_mismatch, hash_mismatch;
+};
+
+/* Open addressing, grows at half full. */
+static struct Shape *shapes = NULL;
+static size_t shapes_cap = 0, shapes_len = 0;
+
+static struct Shape *shape_find(uint64_t fingerprint);
+
+static int record_cmp(const void *a, const void *b) {
+  const struct ResultRecord *ra = a, *rb = b;
+  return (ra->seq > rb->seq) - (ra->seq < rb->seq);
+}
+
+static double shape_regression(const struct Shape *shape) {
+  if (shape->latency_a == 0)
+    return 0;
+  return (double)shape->latency_b / shape->latency_a - 1.0;
+}
+
+/* Worst regressions first */
+static int shape_cmp(const void *a, const void *b) {
+  double ra = shape_regression(a), rb = shape_regression(b);
+  return (ra < rb) - (ra > rb);
+}
+
+static void shape_grow(void) {
+  struct Shape *old = shapes;
+  size_t i, old_cap = shapes_cap;
+
+  shapes_cap = old_cap ? old_cap * 2 : 1024;
+  shapes = calloc(shapes_cap, sizeof(struct Shape));
+  shapes_len = 0;
+
+  for (i = 0; i < old_cap; i++) {
+    if (old[i].count > 0) {
+      *shape_find(old[i].fingerprint) = old[i];
+    }
+  }
+
+  free(old);
+}
+
+static struct Shape *shape_find(uint64_t fingerprint) {
+  size_t i;
+
+  if (shapes_len * 2 >= shapes_cap)
+    shape_grow();
+
+  for (i = fingerprint & (shapes_cap - 1); ; i = (i + 1) & (shapes_cap - 1)) {
+    if (shapes[i].count == 0) {
+      shapes[i].fingerprint = fingerprint;
+      shapes_len++;
+      return &shapes[i];
+    }
+
+    if (shapes[i].fingerprint == fingerprint)
+      return &shapes[i];
+  }
+}
+
+int main(int argc, char **argv) {
+  struct ResultRecord *a, *b;
+  ssize_t na, nb, ia = 0, ib = 0;
+  uint64_t matched = 0, only_a = 0, only_b = 0, mismatched = 0;
+  double threshold = 0.2;
+  size_t i;
+
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <baseline> <candidate> [threshold]\n", argv[0]);
+    return 1;
+  }
+
+  if (argc > 3)
+    threshold = atof(argv[3]);
+
+  if ((na = results_load(argv[1], &a)) < 0 || (nb = results_load(argv[2], &b)) < 0)
+    return 1;
+
+  /* Workers finish out of order */
+  qsort(a, na, sizeof(struct ResultRecord), record_cmp);
+  qsort(b, nb, sizeof(struct ResultRecord), record_cmp);
+
+  while (ia < na && ib < nb) {
+    struct ResultRecord *ra = &a[ia], *rb = &b[ib];
+
+    if (ra->seq < rb->seq) {
+      only_a++;
+      ia++;
+      continue;
+    }
+
+    if (rb->seq < ra->seq) {
+      only_b++;
+      ib++;
+      continue;
+    }
+
+    struct Shape *shape = shape_find(ra->fingerprint);
+    int mismatch = 0;
+
+    shape->count++;
+    shape->latency_a += ra->latency;
+    shape->latency_b += rb->latency;
+
+    if (ra->rows != rb->rows) {
+      shape->rows_mismatch++;
+      mismatch = 1;
+    }
+
+    if (ra->outcome != rb->outcome || memcmp(ra->sqlstate, rb->sqlstate, sizeof(ra->sqlstate))) {
+      shape->status_mismatch++;
+      mismatch = 1;
+    }
+
+    if (ra->hash != rb->hash) {
+      shape->hash_mismatch++;
+      mismatch = 1;
+    }
+
+    mismatched += mismatch;
+    matched++;
+    ia++;
+    ib++;
+  }
+
+  only_a += na - ia;
+  only_b += nb - ib;
+
+  /* Compact and sort the shapes */
+  for (i = 0, shapes_len = 0; i < shapes_cap; i++) {
+    if (shapes[i].count > 0)
+      shapes[shapes_len++] = shapes[i];
+  }
+
+  qsort(shapes, shapes_len, sizeof(struct Shape), shape_cmp);
+
+  printf("Matched %llu statements, %llu with different results; %llu only in baseline, %llu only in candidate.\n",
+    (unsigned long long)matched, (unsigned long long)mismatched,
+    (unsigned long long)only_a, (unsigned long long)only_b);
+
+  printf("%-18s %10s %12s %12s %9s %8s %8s %8s\n",
+    "fingerprint", "count", "baseline_us", "candidate_us", "change", "rows", "status", "hash");
+
+  for (i = 0; i < shapes_len; i++) {
+    struct Shape *shape = &shapes[i];
+    double regression = shape_regression(shape);
+    int mismatch = shape->rows_mismatch || shape->status_mismatch || shape->hash_mismatch;
+
+    /* Only shapes worth looking at */
+    if (regression <= threshold && !mismatch)
+      continue;
+
+    printf("%016llx %10llu %12.1f %12.1f %+8.1f%% %8llu %8llu %8llu\n",
+      (unsigned long long)shape->fingerprint,
+      (unsigned long long)shape->count,
+      (double)shape->latency_a / shape->count,
+      (double)shape->latency_b / shape->count,
+      regression * 100,
+      (unsigned long long)shape->rows_mismatch,
+      (unsigned long long)shape->status_mismatch,
+      (unsigned long long)shape->hash_mismatch);
+  }
+
+  free(a);
+  free(b);
+  free(shapes);
+
+  return mismatched > 0;
+}
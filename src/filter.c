@@ -0,0 +1,165 @@
+/*
+ * Traffic filters.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include "filter.h"
+#include "classify.h"
+#include "helpers.h"
+
+#define MAX_PATTERNS 32
+
+static int sample = 100;
+static char *prefixes[MAX_PATTERNS] = { NULL }, *keywords[MAX_PATTERNS] = { NULL };
+static size_t prefix_lens[MAX_PATTERNS];
+static int nprefixes = 0, nkeywords = 0;
+static int kind = -1; /* enum StatementKind, -1 for any */
+
+/* Per rule counters, parsers update them from several threads */
+static uint64_t f_sample = 0, f_prefix = 0, f_keyword = 0, f_kind = 0;
+
+/*
+ * Split a comma-separated list into patterns.
+ */
+static int filter_patterns(const char *env, char **patterns) {
+  char *list = strdup(env), *pattern, *saveptr = NULL;
+  int n = 0;
+
+  for (pattern = strtok_r(list, ",", &saveptr); pattern != NULL; pattern = strtok_r(NULL, ",", &saveptr)) {
+    if (n == MAX_PATTERNS) {
+      log_info("[Filter] Too many patterns, max is %d", MAX_PATTERNS);
+      break;
+    }
+
+    patterns[n++] = strdup(pattern);
+  }
+
+  free(list);
+  return n;
+}
+
+int filter_init(void) {
+  char *env;
+  int i;
+
+  if ((env = getenv("FILTER_SAMPLE")) != NULL) {
+    sample = atoi(env);
+
+    if (sample < 0 || sample > 100) {
+      log_info("[Filter] FILTER_SAMPLE must be a percentage");
+      return -1;
+    }
+  }
+
+  if ((env = getenv("FILTER_PREFIX")) != NULL) {
+    nprefixes = filter_patterns(env, prefixes);
+
+    for (i = 0; i < nprefixes; i++)
+      prefix_lens[i] = strlen(prefixes[i]);
+  }
+
+  if ((env = getenv("FILTER_KEYWORDS")) != NULL)
+    nkeywords = filter_patterns(env, keywords);
+
+  if ((env = getenv("FILTER_KIND")) != NULL) {
+    if (strcmp(env, "read") == 0)
+      kind = KIND_READ;
+    else if (strcmp(env, "write") == 0)
+      kind = KIND_WRITE;
+    else {
+      log_info("[Filter] FILTER_KIND must be read or write");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Deterministic, so the same clients are kept between runs.
+ */
+int filter_client(uint32_t client_id) {
+  if (sample == 100)
+    return 1;
+
+  if (client_hash(client_id) % 100 < (uint32_t)sample)
+    return 1;
+
+  __atomic_add_fetch(&f_sample, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int filter_query(const char *query) {
+  int i;
+
+  if (nprefixes > 0) {
+    const char *it = query;
+
+    while (isspace((unsigned char)*it))
+      it++;
+
+    for (i = 0; i < nprefixes; i++) {
+      if (strncasecmp(it, prefixes[i], prefix_lens[i]) == 0)
+        break;
+    }
+
+    if (i == nprefixes) {
+      __atomic_add_fetch(&f_prefix, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+  }
+
+  if (nkeywords > 0) {
+    for (i = 0; i < nkeywords; i++) {
+      if (strcasestr(query, keywords[i]) != NULL)
+        break;
+    }
+
+    if (i == nkeywords) {
+      __atomic_add_fetch(&f_keyword, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+  }
+
+  if (kind != -1 && classify(query) != (enum StatementKind)kind) {
+    __atomic_add_fetch(&f_kind, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Log and reset.
+ */
+void filter_stats(void) {
+  if (sample == 100 && !nprefixes && !nkeywords && kind == -1)
+    return;
+
+  log_info("[Filter][Statistics] Filtered by sample: %llu; prefix: %llu; keywords: %llu; kind: %llu.",
+    f_sample, f_prefix, f_keyword, f_kind);
+
+  __atomic_store_n(&f_sample, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&f_prefix, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&f_keyword, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&f_kind, 0, __ATOMIC_RELAXED);
+}
+
+void filter_free(void) {
+  int i;
+
+  for (i = 0; i < nprefixes; i++)
+    free(prefixes[i]);
+
+  for (i = 0; i < nkeywords; i++)
+    free(keywords[i]);
+
+  nprefixes = nkeywords = 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Query shape fingerprint.
+ */
+
+#include <stdint.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "fingerprint.h"
+
+#define PLACEHOLDER '?'
+
+/* Keywords followed by an operand, so a minus after them is a sign */
+static const char *operand_keywords[] = {
+  "select", "where", "and", "or", "not", "when", "then", "else",
+  "limit", "offset", "between", "like", "return", NULL,
+};
+
+/*
+ * FNV-1a over a buffer, continuing from hash.
+ */
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *p = data;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
+
+static inline uint64_t fnv1a_char(uint64_t hash, unsigned char c) {
+  hash ^= c;
+  return hash * FNV_PRIME;
+}
+
+static const unsigned char *skip_space(const unsigned char *it) {
+  while (isspace(*it))
+    it++;
+  return it;
+}
+
+static int operand_keyword(const unsigned char *word, size_t len) {
+  int i;
+
+  for (i = 0; operand_keywords[i] != NULL; i++) {
+    if (strncasecmp((const char *)word, operand_keywords[i], len) == 0 && operand_keywords[i][len] == '\0')
+      return 1;
+  }
+
+  return 0;
+}
+
+enum Token {
+  TOKEN_OTHER,
+  TOKEN_OPERAND, /* A minus after it is binary */
+  TOKEN_WORD,    /* Same, unless it's one of the operand_keywords */
+};
+
+/*
+ * Hash the normalized query without building the normalized string.
+ */
+uint64_t fingerprint(const char *query) {
+  uint64_t hash = FNV_OFFSET;
+  const unsigned char *it = (const unsigned char *)query;
+  int space = 0;
+  const unsigned char *word = NULL; /* Last identifier, only looked at before a minus */
+  size_t word_len = 0;
+  enum Token last = TOKEN_OTHER;
+
+  while (*it) {
+    unsigned char c = *it;
+
+    /* Collapse whitespace */
+    if (isspace(c)) {
+      space = 1;
+      it++;
+      continue;
+    }
+
+    if (space) {
+      hash = fnv1a_char(hash, ' ');
+      space = 0;
+    }
+
+    /* String literal, '' is an escaped quote */
+    if (c == '\'') {
+      it++;
+      while (*it) {
+        if (*it == '\'' && it[1] == '\'') {
+          it += 2;
+        }
+        else if (*it == '\'') {
+          it++;
+          break;
+        }
+        else {
+          it++;
+        }
+      }
+      hash = fnv1a_char(hash, PLACEHOLDER);
+      last = TOKEN_OPERAND;
+    }
+
+    /* Placeholder */
+    else if (c == '$' && isdigit(it[1])) {
+      it++;
+      while (isdigit(*it))
+        it++;
+      hash = fnv1a_char(hash, PLACEHOLDER);
+      last = TOKEN_OPERAND;
+    }
+
+    /* Number, unless it's part of an identifier like table1. The server folds a sign into it, like pg_stat_statements shows. */
+    else if (isdigit(c) || (c == '-' && isdigit(*skip_space(it + 1)) &&
+        (last == TOKEN_OTHER || (last == TOKEN_WORD && operand_keyword(word, word_len))))) {
+      it = skip_space(it + (c == '-'));
+      while (isdigit(*it) || *it == '.')
+        it++;
+      hash = fnv1a_char(hash, PLACEHOLDER);
+      last = TOKEN_OPERAND;
+    }
+
+    /* Identifier or keyword */
+    else if (isalpha(c) || c == '_') {
+      word = it;
+
+      while (isalnum(*it) || *it == '_') {
+        hash = fnv1a_char(hash, tolower(*it));
+        it++;
+      }
+
+      word_len = it - word;
+      last = TOKEN_WORD;
+    }
+
+    else {
+      hash = fnv1a_char(hash, c);
+      last = c == ')' || c == ']' ? TOKEN_OPERAND : TOKEN_OTHER;
+      it++;
+    }
+  }
+
+  return hash;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -13,10 +15,10 @@
  */
 uint32_t parse_uint32(char *data) {
   unsigned a, b, c, d;
-  a = data[0];
-  b = data[1];
-  c = data[2];
-  d = data[3];
+  a = (unsigned char)data[0];
+  b = (unsigned char)data[1];
+  c = (unsigned char)data[2];
+  d = (unsigned char)data[3];
 
   uint32_t result = (a << 24) | (b << 16) | (c << 8) | d;
   return result;
@@ -27,8 +29,8 @@ uint32_t parse_uint32(char *data) {
  */
 uint16_t parse_uint16(char *data) {
   unsigned a, b;
-  a = data[0];
-  b = data[1];
+  a = (unsigned char)data[0];
+  b = (unsigned char)data[1];
   return (a << 8) | (b);
 }
 
@@ -104,6 +106,30 @@ void free_safe(void *ptr, const char *called_from) {
   }
 }
 
+/*
+ * Monotonic clock, in microseconds.
+ */
+uint64_t now_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * SECOND + ts.tv_nsec / 1000;
+}
+
+/*
+ * murmur3 finalizer.
+ */
+uint32_t client_hash(uint32_t client_id) {
+  uint32_t h = client_id;
+
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+
+  return h;
+}
+
 /* Log to stdout */
 void log_info(const char *fmt, ...) {
   char buf[2048]; /* Max log line length = 2048 chars */
@@ -0,0 +1,231 @@
+/*
+ * In-flight budget and overload policy.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "inflight.h"
+#include "helpers.h"
+#include "replayer.h"
+#include "clientset.h"
+
+#define BLOCK_WAIT 10000 /* 10ms, in case we miss a wake up */
+
+enum OverloadPolicy {
+  OVERLOAD_BLOCK,
+  OVERLOAD_SAMPLE,
+  OVERLOAD_DROP_CLIENT,
+};
+
+static enum OverloadPolicy policy = OVERLOAD_BLOCK;
+static uint64_t max_count = 0, max_bytes = 0;
+static uint64_t sample = 10;
+
+/* Current usage, decremented by workers */
+static uint64_t count = 0, bytes = 0;
+
+/* Parser waiting for room */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;
+static int waiting = 0;
+
+/* Clients dropped in this segment, parser threads share it */
+static struct ClientSet dropped_clients;
+static pthread_mutex_t dropped_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t overloaded = 0;
+
+/* Stats, updated atomically by the parsers */
+static uint64_t blocked = 0, blocked_usec = 0, dropped_sample = 0, dropped_client = 0;
+
+/*
+ * Read the budget and policy.
+ */
+int inflight_init(void) {
+  char *env;
+
+  if ((env = getenv("MAX_IN_FLIGHT")) != NULL)
+    max_count = strtoull(env, NULL, 10);
+
+  if ((env = getenv("MAX_IN_FLIGHT_BYTES")) != NULL)
+    max_bytes = strtoull(env, NULL, 10);
+
+  if ((env = getenv("OVERLOAD_SAMPLE")) != NULL && atoi(env) > 0)
+    sample = atoi(env);
+
+  if ((env = getenv("OVERLOAD_POLICY")) != NULL) {
+    if (strcmp(env, "block") == 0)
+      policy = OVERLOAD_BLOCK;
+    else if (strcmp(env, "sample") == 0)
+      policy = OVERLOAD_SAMPLE;
+    else if (strcmp(env, "drop-client") == 0)
+      policy = OVERLOAD_DROP_CLIENT;
+    else {
+      log_info("[InFlight] Unknown OVERLOAD_POLICY %s", env);
+      return -1;
+    }
+  }
+
+  if (max_count || max_bytes)
+    log_info("[InFlight] Budget: %llu statements, %llu bytes, policy %s", max_count, max_bytes, env ? env : "block");
+
+  return 0;
+}
+
+/*
+ * Add n to *counter unless it's already at limit, never going over even for
+ * a moment. Parser threads racing for the last slot can't overshoot together.
+ */
+static int take(uint64_t *counter, uint64_t n, uint64_t limit) {
+  uint64_t current = __atomic_load_n(counter, __ATOMIC_SEQ_CST);
+
+  do {
+    if (limit && current >= limit)
+      return 0;
+  } while (!__atomic_compare_exchange_n(counter, &current, current + n, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+  return 1;
+}
+
+/*
+ * Take room for stmt if it fits. The bytes can go over by one statement,
+ * so one bigger than the whole budget still goes through.
+ */
+static int reserve(struct PStatement *stmt) {
+  if (!take(&count, 1, max_count))
+    return 0;
+
+  if (!take(&bytes, stmt->size, max_bytes)) {
+    __atomic_sub_fetch(&count, 1, __ATOMIC_SEQ_CST);
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Wait for room and take it */
+static void block(struct PStatement *stmt) {
+  uint64_t start = now_usec();
+
+  pthread_mutex_lock(&lock);
+  waiting++;
+
+  while (!reserve(stmt)) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += BLOCK_WAIT * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&room, &lock, &ts);
+  }
+
+  waiting--;
+  pthread_mutex_unlock(&lock);
+
+  __atomic_add_fetch(&blocked, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&blocked_usec, now_usec() - start, __ATOMIC_RELAXED);
+}
+
+/*
+ * Is the client dropped for this segment? Adds it if add is set.
+ */
+static int client_dropped(uint32_t client_id, int add) {
+  int dropped;
+
+  pthread_mutex_lock(&dropped_lock);
+  dropped = add ? clientset_add(&dropped_clients, client_id) : clientset_has(&dropped_clients, client_id);
+  pthread_mutex_unlock(&dropped_lock);
+
+  return dropped;
+}
+
+/*
+ * Should stmt be dispatched? The budget is a hard limit, whatever the policy.
+ */
+int inflight_admit(struct PStatement *stmt) {
+  uint64_t n;
+
+  if (policy == OVERLOAD_DROP_CLIENT && client_dropped(stmt->client_id, 0)) {
+    __atomic_add_fetch(&dropped_client, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  if (reserve(stmt))
+    return 1;
+
+  n = __atomic_fetch_add(&overloaded, 1, __ATOMIC_RELAXED);
+
+  if (n == 0 || DEBUG)
+    log_info("[InFlight] Over budget: %llu statements, %llu bytes in flight", count, bytes);
+
+  switch (policy) {
+    case OVERLOAD_BLOCK:
+      break;
+
+    /* The ones kept wait for room like with block */
+    case OVERLOAD_SAMPLE:
+      if (n % sample != 0) {
+        __atomic_add_fetch(&dropped_sample, 1, __ATOMIC_RELAXED);
+        return 0;
+      }
+      break;
+
+    /* Dropped even when the set is full, the client just won't stay dropped */
+    case OVERLOAD_DROP_CLIENT:
+      client_dropped(stmt->client_id, 1);
+      __atomic_add_fetch(&dropped_client, 1, __ATOMIC_RELAXED);
+      return 0;
+  }
+
+  block(stmt);
+  return 1;
+}
+
+/*
+ * Called by the worker that freed the statement.
+ */
+void inflight_done(uint32_t size) {
+  __atomic_sub_fetch(&count, 1, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(&bytes, size, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&lock);
+    pthread_cond_broadcast(&room);
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+uint64_t inflight_count(void) {
+  return __atomic_load_n(&count, __ATOMIC_SEQ_CST);
+}
+
+void inflight_segment_end(void) {
+  pthread_mutex_lock(&dropped_lock);
+  clientset_clear(&dropped_clients);
+  pthread_mutex_unlock(&dropped_lock);
+}
+
+/*
+ * Log and reset.
+ */
+void inflight_stats(void) {
+  if (!max_count && !max_bytes)
+    return;
+
+  log_info("[InFlight][Statistics] In flight: %llu statements, %llu bytes; Over budget: %llu; Blocked: %llu for %.2f seconds; Dropped (sample): %llu; Dropped (client): %llu.",
+    __atomic_load_n(&count, __ATOMIC_SEQ_CST), __atomic_load_n(&bytes, __ATOMIC_SEQ_CST),
+    overloaded, blocked, (double)blocked_usec / SECOND, dropped_sample, dropped_client);
+
+  __atomic_store_n(&overloaded, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&blocked, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&blocked_usec, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&dropped_sample, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&dropped_client, 0, __ATOMIC_RELAXED);
+}
@@ -22,116 +22,75 @@
 #include <errno.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "replayer.h"
-
-/*
- * Separator between packets.
- */
-#define DELIMETER '\x19' /* EM */
-#define LIST_SIZE 4096
-
 #include "helpers.h"
 #include "statement.h"
 #include "parameter.h"
 #include "postgres.h"
+#include "inflight.h"
+#include "amplify.h"
+#include "filter.h"
+#include "parser.h"
+#include "spool.h"
+#include "segment.h"
+#include "pgstat.h"
+#include "ratelimit.h"
 
-/* Throttle logging */
-static int erred = 0;
+#define MAX_PARSERS 256
 
 /* Stats */
-static int q_sent = 0, q_dropped = 0;
+static int q_sent = 0, q_dropped = 0, q_source = 0;
+
+/* Records seen in the packet log so far, used to match results between runs. */
+static uint64_t seq = 0;
 static double total_seconds = 0;
 
 /* Show extra info in logs. Used across the code base. */
 int DEBUG = 0;
-static struct PStatement *list[4098] = { NULL };
 
-/* Safe iterator move.
- *
- * Usually indicates a corrupt packet in the log file.
- */
-#define move_it(it, offset, buf, len) do { \
-  if (*it + offset >= buf + len) { \
-    goto next_line; \
-  } \
-  *it += offset; \
-  } while (0);
+/* Parser threads, PARSER_THREADS */
+static struct Parser *parsers[MAX_PARSERS];
+static int nparsers = 1;
 
 /*
- * Will execute a preparted statement against a connection in the pool.
+ * Hand the statement to the pool, unless we're over the in-flight budget.
  */
-void pexec(struct PStatement *stmt) {
-  assert(stmt != NULL);
+static void dispatch(struct Parser *parser, struct PStatement *stmt) {
+  if (!inflight_admit(stmt)) {
+    pstatement_free(stmt);
+    parser->dropped++;
+    return;
+  }
 
+  /* After admission, a dropped statement would use up a token */
+  ratelimit_wait(stmt);
+  ratelimit_admitted(stmt);
   postgres_assign(stmt);
+  parser->sent++;
 }
 
 /*
- * Rotate packet logfile so the bouncer can log some more.
+ * Will execute a preparted statement against a connection in the pool,
+ * once per virtual client when amplifying.
  */
-int rotate_logfile(char *new_fn, const char *fn) {
-  int res;
-  char lock_fn[strlen(fn) + 6];
-
-  /* lock file for concurrent log file access */
-  sprintf(lock_fn, "%s.lock", fn);
-
-  /* rotate log file to this */
-  sprintf(new_fn, "%s.1", fn);
-
-  /* Get exclusive lock & rotate */
-  FILE *fd = fopen(lock_fn, "w");
-
-  /* Try again if we can't get a lock */
-  if (flock(fileno(fd), LOCK_EX) == EWOULDBLOCK) {
-    log_info("[Rotation] Could not get lock on %s: %s", lock_fn, strerror(errno));
-    return 1;
-  }
-
-  /* Rotate */
-  if ((res = rename(fn, new_fn))) {
-    if (!erred) { /* log errors only once per occurence */
-      log_info("[Rotation] Could not rename %s: %s", fn, strerror(errno));
-      erred = 1;
-    }
-  }
-  else
-    erred = 0;
+static void pexec(struct Parser *parser, struct PStatement *stmt) {
+  int k, factor = amplify_current();
+  uint64_t record = stmt->seq;
 
-  flock(fileno(fd), LOCK_UN);
-  fclose(fd);
-  return res;
-}
-
-/*
- * Find the prepared statement in our linked list.
- */
-struct PStatement *pstatement_find(uint32_t client_id) {
-  int i;
-  for (i = 0; i < LIST_SIZE; i++) {
-    if (list[i] != NULL && list[i]->client_id == client_id) {
-      struct PStatement *stmt = list[i];
-      list[i] = NULL;
-      return stmt;
-    }
-  }
-  return NULL;
-}
+  assert(stmt != NULL);
 
-/*
- * Add the prepared statement into our linked list.
- */
-int pstatement_add(struct PStatement *stmt) {
-  int i;
-  for (i = 0; i < LIST_SIZE; i++) {
-    if (list[i] == NULL) {
-      list[i] = stmt;
-      return 0;
-    }
+  /* Copy before dispatching, a worker could free the original right away. */
+  for (k = 1; k < factor; k++) {
+    struct PStatement *copy = amplify_clone(stmt, k);
+    copy->seq = record * amplify_max() + k;
+    dispatch(parser, copy);
   }
 
-  return 1; /* list full */
+  stmt->seq = record * amplify_max();
+  dispatch(parser, stmt);
+  parser->source++;
 }
 
 /*
@@ -140,11 +99,8 @@ int pstatement_add(struct PStatement *stmt) {
  *   - read log file and replay packets against mirror DB
  */
 int main_loop() {
-  FILE *f;
-  char *line = NULL, *it, *env_f_name;
-  size_t line_len;
-  ssize_t nread;
-  int i, len;
+  char *env_f_name;
+  int i, len, res;
   struct timeval start, end;
   double seconds;
 
@@ -155,7 +111,7 @@ int main_loop() {
    * Log file
    */
   char fname[512];
-  char new_fn[514];
+  char new_fn[600];
 
   if ((env_f_name = getenv("PACKET_FILE")) == NULL) {
     /* By default it's in /tmp */
@@ -167,170 +123,50 @@ int main_loop() {
   }
 
   /* Can't go forward unless we can rotate the file. */
-  if (rotate_logfile(new_fn, fname)) {
+  if (spool_next(new_fn, sizeof(new_fn), fname)) {
     return 1;
   }
 
-  f = fopen(new_fn, "r");
+  /* The segment is read once, each parser gets the records of its own clients. */
+  for (i = 0; i < nparsers; i++) {
+    parsers[i]->seq = seq;
+  }
+
+  res = parser_run_all(parsers, nparsers, new_fn);
 
-  if (f == NULL) {
-    log_info("[Main] Could not open packet log");
+  if (res > 0)
     return 1;
-  }
 
-  while ((nread = getdelim(&line, &line_len, DELIMETER, f)) > 0) {
-    /* Not enough data to be a valid line.
-     *
-     * 5 bytes would have the tag (char) & packet length (32-bit int)
-     */
-    if (line_len < 5) {
-      continue;
-    }
-
-    /* Place the iterator at the beginning. */
-    it = line;
-
-    uint32_t client_id = parse_uint32(it);
-    move_it(&it, 4, line, nread);
-
-    /* Parse the tag and move forward */
-    char tag = *it;
-    move_it(&it, 1, line, nread);
-
-    /* Parse the len of the packet and move forward. */
-    /*uint32_t len = parse_uint32(it); TODO: Use this len to parse the packet */
-    move_it(&it, 4, line, nread);
-
-    /* Simple query, 'Q' packet */
-    if (tag == 'Q') {
-      struct PStatement *stmt = pstatement_init(it, client_id);
-      pexec(stmt);
-      q_sent += 1;
-    }
-
-    /* Prepared statement, 'P' packet */
-    else if (tag == 'P') {
-      /*
-       * str stmt
-       * str query
-       */
-      char *stmt_name = it;
-      char *query = it + strlen(stmt_name) + 1; /* +1 for the NULL character. */
-
-      struct PStatement *stmt = pstatement_init(query, client_id);
-      if (pstatement_add(stmt)) {
-        q_dropped++;
-        if (DEBUG)
-          log_info("[Main] List full, dropping statement");
-        pstatement_free(stmt);
-      }
-    }
-
-    /* Bind parameter(s), 'B' packet */
-    else if (tag == 'B') {
-      /* Find the statement this bind belongs to */
-      struct PStatement *stmt = pstatement_find(client_id);
-
-      if (stmt == NULL) {
-        q_dropped++;
-        if (DEBUG)
-          log_info("[Main] Dropping out of order Bind packet for client %d", client_id);
-        goto next_line;
-      }
-
-      /* Parse the packet */
-
-      char *portal = it; /* Portal, can be empty */
-      move_it(&it, strlen(portal) + 1, line, nread);
-      /* move_it(&it, strlen(portal) + 1, line, line_len); */ /* Skip it for now */
-
-      char *statement = it; /* Statement name, if any  */
-      move_it(&it, strlen(statement) + 1, line, nread); /* Also not using it for now */
-
-      uint16_t nf = parse_uint16(it); /* number of formats used */
-      move_it(&it, 2, line, nread); /* Parsed it, now move forward */
-
-      /* Parse each format */
-      for (i = 0; i < nf; i++) {
-        /* uint16_t fmt = parse_uint16(it); */
-        move_it(&it, 2, line, nread);
-      }
-
-      /* Number of parameters */
-      uint16_t np = parse_uint16(it);
-      move_it(&it, 2, line, nread); /* move iterator forward 2 bytes */
-
-      /* Save the params */
-      for (i = 0; i < np; i++) {
-        int32_t plen = (int32_t)parse_uint32(it); /* Parameter length */
-        move_it(&it, 4, line, nread); /* 4 bytes */
-
-        struct Parameter *parameter = parameter_init(plen, it);
-
-        pstatement_add_param(stmt, parameter);
-        move_it(&it, plen, line, nread);
-      }
-
-      pstatement_add(stmt); /* Add back to list */
-    }
-
-    /* Execute the prepared statement, 'E' packet */
-    else if (tag == 'E') {
-      struct PStatement *stmt = pstatement_find(client_id);
-      if (stmt == NULL) {
-        q_dropped++;
-        if (DEBUG)
-          log_info("[Main] Dropping out of order E packet for client %d", client_id);
-        goto next_line;
-      }
-
-      pexec(stmt);
-
-      if (DEBUG)
-        pstatement_debug(stmt);
-
-      /* The worker will deallocate this object */
-      stmt = NULL;
-      q_sent += 1;
-    }
-
-    else {
-      /* BUG: fix corruption in the packet log file */
-      /* This still happens, but logs too much */
-
-      /* printf("Unsupported tag: %c\n",  tag); */
-      /* hexDump("line", line, line_len); */
-    }
-
-    /* Clear the line buffer */
-  next_line:
-    memset(line, 0, line_len);
-  }
+  /* They all end at the same record */
+  seq = parsers[0]->seq;
 
-  /* Let getdelim re-allocate memory */
-  free(line);
-  line = NULL;
+  /* Remove the packet log file we just read, unless we only got part of it */
+  if (res < 0) {
+    char failed_fn[sizeof(new_fn) + 8];
 
-  /* Close the packet log file we just read and remove it */
-  fclose(f);
-  unlink(new_fn);
+    snprintf(failed_fn, sizeof(failed_fn), "%s.failed", new_fn);
+    log_info("[Main] Only part of %s was replayed, keeping it as %s", new_fn, failed_fn);
+
+    if (rename(new_fn, failed_fn))
+      log_info("[Main] Could not rename %s: %s", new_fn, strerror(errno));
+  }
+  else {
+    unlink(new_fn);
+  }
+
+  inflight_segment_end();
 
-  /* Clean up any orphaned statements.
-   *
-   * They can become orphaned because packets are out-of-order in the packet log file
-   * or have not been logged at all.
-   */
   len = 0;
-  for (i = 0; i < LIST_SIZE; i++) {
-    if (list[i] != NULL) {
-      pstatement_free(list[i]);
-      list[i] = NULL;
-      len++;
-    }
+  for (i = 0; i < nparsers; i++) {
+    q_sent += parsers[i]->sent;
+    q_dropped += parsers[i]->dropped;
+    q_source += parsers[i]->source;
+    len += parsers[i]->orphaned;
+    parser_reset(parsers[i]);
   }
 
   if (len > 0)
-    log_info("Orphaned queries: %lu", len);
+    log_info("Orphaned queries: %d", len);
 
   /* Benchmark how we did */
   gettimeofday(&end, NULL);
@@ -343,7 +179,15 @@ int main_loop() {
   if (q_sent > 2048) {
     log_info("[Main][Statistics] Sent %d queries and dropped %d packets in %.2f seconds", q_sent, q_dropped, total_seconds);
     postgres_stats();
+    pgstat_snapshot();
+    inflight_stats();
+    ratelimit_stats();
+    filter_stats();
+    amplify_stats(q_source, q_sent, total_seconds);
+    segment_stats();
+    spool_stats(fname, q_sent, q_dropped);
     q_sent = 0;
+    q_source = 0;
     q_dropped = 0;
     total_seconds = 0;
   }
@@ -355,7 +199,14 @@ int main_loop() {
  * Clean up everything if clean shut down.
  */
 void cleanup(int signo) {
+  int i;
+
   postgres_free();
+  pgstat_free();
+  filter_free();
+
+  for (i = 0; i < nparsers; i++)
+    parser_free(parsers[i]);
 
   log_info("Exiting. Bye!");
   exit(0);
@@ -365,6 +216,8 @@ void cleanup(int signo) {
  * Entrypoint.
  */
 int main() {
+  int i;
+
   log_info("PGReplayer %.2f started. Waiting for packets", VERSION);
   char *debug = getenv("DEBUG");
   if (debug != NULL) {
@@ -375,11 +228,30 @@ int main() {
     log_info("libpq version: %d", PQlibVersion());
   }
 
-  if (postgres_init()) {
+  if (inflight_init() || amplify_init() || filter_init() || spool_init() || ratelimit_init()) {
+    exit(1);
+  }
+
+  /* More virtual clients need more connections */
+  if (postgres_init(amplify_max())) {
     log_info("Postgres pool failed to initialize");
     exit(1);
   }
 
+  if (pgstat_init()) {
+    exit(1);
+  }
+
+  char *parser_threads = getenv("PARSER_THREADS");
+  if (parser_threads != NULL && atoi(parser_threads) > 0) {
+    nparsers = atoi(parser_threads) < MAX_PARSERS ? atoi(parser_threads) : MAX_PARSERS;
+    log_info("Parsing with %d threads", nparsers);
+  }
+
+  for (i = 0; i < nparsers; i++) {
+    parsers[i] = parser_init(i, nparsers, pexec, NULL);
+  }
+
   if (signal(SIGINT, cleanup) == SIG_ERR) {
     log_info("Can't catch signals, so no clean up will be done on shutdown");
   }
@@ -0,0 +1,375 @@
+/*
+ * Mock PostgreSQL server, to measure the replayer without a database.
+ *
+ * Usage: mockpg
+ *
+ * Speaks enough of the v3 protocol for libpq: trust authentication,
+ * simple Query and Parse/Bind/Describe/Execute/Sync. Every query returns
+ * the same result after a fixed latency. Configured with:
+ *
+ *   MOCK_PORT:        port to listen on, localhost only (default 5433),
+ *   MOCK_LATENCY_US:  microseconds to wait before each result (default 0),
+ *   MOCK_ROWS:        rows in each result (default 1),
+ *   MOCK_ROW_SIZE:    bytes in the only column of each row (default 16).
+ *
+ * Then replay with DATABASE_URL=postgres://mock@127.0.0.1:5433/mock.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "replayer.h"
+#include "helpers.h"
+
+int DEBUG = 0;
+
+#define SSL_REQUEST 80877103
+#define GSSENC_REQUEST 80877104
+#define CANCEL_REQUEST 80877102
+#define MAX_MESSAGE (64 * 1024 * 1024)
+#define OUT_SIZE (64 * 1024)
+
+static int latency = 0, rows = 1, row_size = 16;
+static char *row = NULL;
+
+/* Stats */
+static uint64_t connections = 0, queries = 0;
+
+struct Conn {
+  int fd;
+  FILE *in;
+  char out[OUT_SIZE];
+  size_t out_len;
+};
+
+static int flush_out(struct Conn *conn) {
+  size_t pos = 0;
+
+  while (pos < conn->out_len) {
+    ssize_t n = write(conn->fd, conn->out + pos, conn->out_len - pos);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    pos += n;
+  }
+
+  conn->out_len = 0;
+  return 0;
+}
+
+static int put(struct Conn *conn, const void *data, size_t len) {
+  if (conn->out_len + len > OUT_SIZE) {
+    if (flush_out(conn))
+      return -1;
+
+    /* Too big for the buffer, write it directly */
+    if (len > OUT_SIZE)
+      return write(conn->fd, data, len) == (ssize_t)len ? 0 : -1;
+  }
+
+  memcpy(conn->out + conn->out_len, data, len);
+  conn->out_len += len;
+  return 0;
+}
+
+static int put_uint32(struct Conn *conn, uint32_t value) {
+  uint32_t n = htonl(value);
+  return put(conn, &n, 4);
+}
+
+static int put_uint16(struct Conn *conn, uint16_t value) {
+  uint16_t n = htons(value);
+  return put(conn, &n, 2);
+}
+
+/* Message header, len is the body without the length itself */
+static int put_header(struct Conn *conn, char type, uint32_t len) {
+  return put(conn, &type, 1) || put_uint32(conn, len + 4);
+}
+
+static int parameter_status(struct Conn *conn, const char *name, const char *value) {
+  return put_header(conn, 'S', strlen(name) + 1 + strlen(value) + 1) ||
+    put(conn, name, strlen(name) + 1) ||
+    put(conn, value, strlen(value) + 1);
+}
+
+static int ready_for_query(struct Conn *conn) {
+  return put_header(conn, 'Z', 1) || put(conn, "I", 1) || flush_out(conn);
+}
+
+/* One text column */
+static int row_description(struct Conn *conn) {
+  static const char name[] = "mock";
+
+  return put_header(conn, 'T', 2 + sizeof(name) + 4 + 2 + 4 + 2 + 4 + 2) ||
+    put_uint16(conn, 1) ||
+    put(conn, name, sizeof(name)) ||
+    put_uint32(conn, 0) ||  /* Table */
+    put_uint16(conn, 0) ||  /* Column */
+    put_uint32(conn, 25) || /* text */
+    put_uint16(conn, -1) || /* Variable length */
+    put_uint32(conn, -1) || /* No modifier */
+    put_uint16(conn, 0);    /* Text format */
+}
+
+/*
+ * The rows and CommandComplete, after the latency.
+ */
+static int result(struct Conn *conn) {
+  char tag[32];
+  int i;
+
+  __atomic_add_fetch(&queries, 1, __ATOMIC_RELAXED);
+
+  if (latency > 0) {
+    /* Don't sit on what we have already */
+    if (flush_out(conn))
+      return -1;
+    usleep(latency);
+  }
+
+  for (i = 0; i < rows; i++) {
+    if (put_header(conn, 'D', 2 + 4 + row_size) ||
+      put_uint16(conn, 1) ||
+      put_uint32(conn, row_size) ||
+      put(conn, row, row_size))
+      return -1;
+  }
+
+  snprintf(tag, sizeof(tag), "SELECT %d", rows);
+  return put_header(conn, 'C', strlen(tag) + 1) || put(conn, tag, strlen(tag) + 1);
+}
+
+static int read_uint32(FILE *in, uint32_t *value) {
+  if (fread(value, 4, 1, in) != 1)
+    return -1;
+
+  *value = ntohl(*value);
+  return 0;
+}
+
+/*
+ * Startup, SSL and GSS encryption requests get turned down. Returns 1 for cancel requests.
+ */
+static int startup(struct Conn *conn, char **body) {
+  uint32_t len, code;
+
+  for (;;) {
+    if (read_uint32(conn->in, &len) || len < 8 || len > MAX_MESSAGE)
+      return -1;
+
+    *body = realloc(*body, len - 4);
+
+    if (fread(*body, len - 4, 1, conn->in) != 1)
+      return -1;
+
+    code = parse_uint32(*body);
+
+    if (code == SSL_REQUEST || code == GSSENC_REQUEST) {
+      if (write(conn->fd, "N", 1) != 1)
+        return -1;
+      continue;
+    }
+
+    /* Queries finish on their own */
+    if (code == CANCEL_REQUEST)
+      return 1;
+
+    break;
+  }
+
+  /* AuthenticationOk, trust */
+  if (put_header(conn, 'R', 4) || put_uint32(conn, 0))
+    return -1;
+
+  if (parameter_status(conn, "server_version", "15.0") ||
+    parameter_status(conn, "server_encoding", "UTF8") ||
+    parameter_status(conn, "client_encoding", "UTF8") ||
+    parameter_status(conn, "DateStyle", "ISO, MDY") ||
+    parameter_status(conn, "integer_datetimes", "on") ||
+    parameter_status(conn, "standard_conforming_strings", "on"))
+    return -1;
+
+  /* BackendKeyData */
+  if (put_header(conn, 'K', 8) || put_uint32(conn, getpid()) || put_uint32(conn, conn->fd))
+    return -1;
+
+  return ready_for_query(conn);
+}
+
+static void *serve(void *arg) {
+  struct Conn *conn = (struct Conn *)arg;
+  char *body = NULL, type;
+  uint32_t len;
+  int res;
+
+  conn->in = fdopen(conn->fd, "r");
+
+  if ((res = startup(conn, &body)) != 0)
+    goto done;
+
+  while ((res = fread(&type, 1, 1, conn->in)) == 1) {
+    if (read_uint32(conn->in, &len) || len < 4 || len > MAX_MESSAGE)
+      break;
+
+    body = realloc(body, len - 4 + 1);
+
+    if (len > 4 && fread(body, len - 4, 1, conn->in) != 1)
+      break;
+
+    res = 0;
+
+    switch (type) {
+      /* Simple query */
+      case 'Q':
+        res = row_description(conn) || result(conn) || ready_for_query(conn);
+        break;
+
+      /* ParseComplete */
+      case 'P':
+        res = put_header(conn, '1', 0);
+        break;
+
+      /* BindComplete */
+      case 'B':
+        res = put_header(conn, '2', 0);
+        break;
+
+      /* Statement: no parameters we know of, then the row. Portal: the row. */
+      case 'D':
+        if (len > 4 && body[0] == 'S')
+          res = put_header(conn, 't', 2) || put_uint16(conn, 0);
+        res = res || row_description(conn);
+        break;
+
+      case 'E':
+        res = result(conn);
+        break;
+
+      /* CloseComplete */
+      case 'C':
+        res = put_header(conn, '3', 0);
+        break;
+
+      case 'S':
+        res = ready_for_query(conn);
+        break;
+
+      case 'H':
+        res = flush_out(conn);
+        break;
+
+      case 'X':
+        goto done;
+
+      /* Anything else is ignored */
+      default:
+        break;
+    }
+
+    if (res)
+      break;
+  }
+
+done:
+  fclose(conn->in);
+  free(body);
+  free(conn);
+  __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static int env_int(const char *name, int value) {
+  char *env = getenv(name);
+  return env != NULL ? atoi(env) : value;
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_in addr;
+  int fd, one = 1, port;
+  pthread_attr_t attr;
+
+  port = env_int("MOCK_PORT", 5433);
+  latency = env_int("MOCK_LATENCY_US", 0);
+  rows = env_int("MOCK_ROWS", 1);
+  row_size = env_int("MOCK_ROW_SIZE", 16);
+  DEBUG = env_int("DEBUG", 0);
+
+  if (rows < 0 || row_size < 0 || latency < 0) {
+    log_info("[Mock] MOCK_ROWS, MOCK_ROW_SIZE and MOCK_LATENCY_US can't be negative");
+    return 2;
+  }
+
+  row = malloc(row_size + 1);
+  memset(row, 'x', row_size);
+
+  /* Clients hanging up are not our problem */
+  signal(SIGPIPE, SIG_IGN);
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1024)) {
+    log_info("[Mock] Could not listen on port %d: %s", port, strerror(errno));
+    return 1;
+  }
+
+  log_info("[Mock] Listening on 127.0.0.1:%d; latency %d us, %d rows of %d bytes", port, latency, rows, row_size);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (;;) {
+    pthread_t thread;
+    struct Conn *conn;
+    int client = accept(fd, NULL, NULL);
+
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      log_info("[Mock] accept: %s", strerror(errno));
+      break;
+    }
+
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn = calloc(1, sizeof(struct Conn));
+    conn->fd = client;
+
+    __atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+
+    if (DEBUG)
+      log_info("[Mock] Connection, %llu open; %llu queries so far", connections, queries);
+
+    if (pthread_create(&thread, &attr, serve, conn)) {
+      close(client);
+      free(conn);
+      __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  close(fd);
+  free(row);
+  return 1;
+}
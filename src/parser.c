@@ -0,0 +1,592 @@
+/*
+ * Packet log parser.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "replayer.h"
+#include "helpers.h"
+#include "statement.h"
+#include "parameter.h"
+#include "parser.h"
+#include "filter.h"
+#include "clientset.h"
+#include "spool.h"
+#include "segment.h"
+
+/* Safe iterator move.
+ *
+ * Usually indicates a corrupt packet in the log file.
+ */
+#define move_it(it, offset, buf, len) do { \
+  if (*it + offset >= buf + len) { \
+    goto next_line; \
+  } \
+  *it += offset; \
+  } while (0);
+
+#define WINDOW_SIZE (16 * 1024 * 1024) /* Bytes of the segment parsed at once by several parsers */
+
+/*
+ * A record of the window being parsed, see parser_run_all().
+ */
+struct RecordRef {
+  uint32_t off, len;
+  uint32_t seq; /* Position in its range */
+};
+
+struct Refs {
+  struct RecordRef *refs;
+  size_t len, cap;
+};
+
+/*
+ * A window of the segment, split into one byte range per parser.
+ */
+struct Split {
+  char *data;
+  struct Parser **parsers;
+  int nparsers;
+  size_t *starts;       /* nparsers + 1 range bounds, at record boundaries */
+  uint32_t *counts;     /* Records in each range, as counted by parser_record() */
+  struct Refs *refs;    /* Records of each range for each parser, [range * nparsers + parser] */
+  uint64_t seq;         /* Position of the window's first record */
+};
+
+struct SplitJob {
+  struct Split *split;
+  int id;
+};
+
+struct Parser *parser_init(int id, int nparsers, parser_exec_fn exec, void *arg) {
+  struct Parser *parser = calloc(1, sizeof(struct Parser));
+
+  parser->id = id;
+  parser->nparsers = nparsers;
+  parser->exec = exec;
+  parser->arg = arg;
+
+  return parser;
+}
+
+/*
+ * Find the prepared statement in our linked list.
+ */
+static struct PStatement *pstatement_find(struct Parser *parser, uint32_t client_id) {
+  int i;
+  for (i = 0; i < LIST_SIZE; i++) {
+    if (parser->list[i] != NULL && parser->list[i]->client_id == client_id) {
+      struct PStatement *stmt = parser->list[i];
+      parser->list[i] = NULL;
+      return stmt;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Add the prepared statement into our linked list.
+ */
+static int pstatement_add(struct Parser *parser, struct PStatement *stmt) {
+  int i;
+  for (i = 0; i < LIST_SIZE; i++) {
+    if (parser->list[i] == NULL) {
+      parser->list[i] = stmt;
+      return 0;
+    }
+  }
+
+  return 1; /* list full */
+}
+
+/*
+ * Hand the statement over, it's positioned at the record we're on.
+ */
+static void pexec(struct Parser *parser, struct PStatement *stmt) {
+  stmt->seq = parser->seq;
+  parser->exec(parser, stmt);
+}
+
+/*
+ * Parse one record.
+ */
+void parser_record(struct Parser *parser, char *line, ssize_t nread) {
+  char *it;
+  int i;
+
+  /* Not enough data to be a valid line.
+   *
+   * 5 bytes would have the tag (char) & packet length (32-bit int)
+   */
+  if (nread < 5) {
+    return;
+  }
+
+  /* Place the iterator at the beginning. */
+  it = line;
+
+  uint32_t client_id = parse_uint32(it);
+  move_it(&it, 4, line, nread);
+
+  /* Not our client, another replayer instance has it */
+  if (!spool_owns(client_id)) {
+    goto next_line;
+  }
+
+  /* Parse the tag and move forward */
+  char tag = *it;
+  move_it(&it, 1, line, nread);
+
+  /* Parse the len of the packet and move forward. */
+  /*uint32_t len = parse_uint32(it); TODO: Use this len to parse the packet */
+  move_it(&it, 4, line, nread);
+
+  /* Filter before allocating anything */
+  if (!filter_client(client_id)) {
+    goto next_line;
+  }
+
+  /* Simple query, 'Q' packet */
+  if (tag == 'Q') {
+    if (!filter_query(it))
+      goto next_line;
+
+    struct PStatement *stmt = pstatement_init(it, client_id);
+    pexec(parser, stmt);
+  }
+
+  /* Prepared statement, 'P' packet */
+  else if (tag == 'P') {
+    /*
+     * str stmt
+     * str query
+     */
+    char *stmt_name = it;
+    char *query = it + strlen(stmt_name) + 1; /* +1 for the NULL character. */
+
+    if (!filter_query(query)) {
+      clientset_add(&parser->filtered, client_id);
+      goto next_line;
+    }
+
+    clientset_remove(&parser->filtered, client_id);
+
+    struct PStatement *stmt = pstatement_init(query, client_id);
+    if (pstatement_add(parser, stmt)) {
+      parser->dropped++;
+      if (DEBUG)
+        log_info("[Main] List full, dropping statement");
+      pstatement_free(stmt);
+    }
+  }
+
+  /* Bind parameter(s), 'B' packet */
+  else if (tag == 'B') {
+    if (clientset_has(&parser->filtered, client_id))
+      goto next_line;
+
+    /* Find the statement this bind belongs to */
+    struct PStatement *stmt = pstatement_find(parser, client_id);
+
+    if (stmt == NULL) {
+      parser->dropped++;
+      if (DEBUG)
+        log_info("[Main] Dropping out of order Bind packet for client %d", client_id);
+      goto next_line;
+    }
+
+    /* Parse the packet */
+
+    char *portal = it; /* Portal, can be empty */
+    move_it(&it, strlen(portal) + 1, line, nread);
+    /* move_it(&it, strlen(portal) + 1, line, line_len); */ /* Skip it for now */
+
+    char *statement = it; /* Statement name, if any  */
+    move_it(&it, strlen(statement) + 1, line, nread); /* Also not using it for now */
+
+    uint16_t nf = parse_uint16(it); /* number of formats used */
+    move_it(&it, 2, line, nread); /* Parsed it, now move forward */
+
+    /* Parse each format */
+    for (i = 0; i < nf; i++) {
+      /* uint16_t fmt = parse_uint16(it); */
+      move_it(&it, 2, line, nread);
+    }
+
+    /* Number of parameters */
+    uint16_t np = parse_uint16(it);
+    move_it(&it, 2, line, nread); /* move iterator forward 2 bytes */
+
+    /* Save the params */
+    for (i = 0; i < np; i++) {
+      int32_t plen = (int32_t)parse_uint32(it); /* Parameter length */
+      move_it(&it, 4, line, nread); /* 4 bytes */
+
+      struct Parameter *parameter = parameter_init(plen, it);
+
+      pstatement_add_param(stmt, parameter);
+      move_it(&it, plen, line, nread);
+    }
+
+    pstatement_add(parser, stmt); /* Add back to list */
+  }
+
+  /* Execute the prepared statement, 'E' packet */
+  else if (tag == 'E') {
+    if (clientset_has(&parser->filtered, client_id)) {
+      clientset_remove(&parser->filtered, client_id);
+      goto next_line;
+    }
+
+    struct PStatement *stmt = pstatement_find(parser, client_id);
+    if (stmt == NULL) {
+      parser->dropped++;
+      if (DEBUG)
+        log_info("[Main] Dropping out of order E packet for client %d", client_id);
+      goto next_line;
+    }
+
+    if (DEBUG)
+      pstatement_debug(stmt);
+
+    /* The worker will deallocate this object */
+    pexec(parser, stmt);
+    stmt = NULL;
+  }
+
+  else {
+    /* BUG: fix corruption in the packet log file */
+    /* This still happens, but logs too much */
+
+    /* printf("Unsupported tag: %c\n",  tag); */
+    /* hexDump("line", line, line_len); */
+  }
+
+next_line:
+  parser->seq++;
+}
+
+/*
+ * Done with a segment.
+ */
+static void parser_finish(struct Parser *parser) {
+  int i;
+
+  clientset_clear(&parser->filtered);
+
+  /* Clean up any orphaned statements.
+   *
+   * They can become orphaned because packets are out-of-order in the packet log file
+   * or have not been logged at all.
+   */
+  for (i = 0; i < LIST_SIZE; i++) {
+    if (parser->list[i] != NULL) {
+      pstatement_free(parser->list[i]);
+      parser->list[i] = NULL;
+      parser->orphaned++;
+    }
+  }
+}
+
+/*
+ * Parse a whole segment.
+ */
+int parser_run(struct Parser *parser, const char *fn) {
+  struct Segment segment;
+  FILE *f;
+  char *line = NULL;
+  size_t line_len;
+  ssize_t nread;
+  int res;
+
+  f = segment_open(&segment, fn);
+
+  if (f == NULL) {
+    log_info("[Main] Could not open packet log");
+    return 1;
+  }
+
+  while ((nread = getdelim(&line, &line_len, DELIMETER, f)) > 0) {
+    parser_record(parser, line, nread);
+
+    /* Clear the line buffer */
+    memset(line, 0, line_len);
+  }
+
+  /* Let getdelim re-allocate memory */
+  free(line);
+  line = NULL;
+
+  res = segment_close(&segment);
+  parser_finish(parser);
+
+  return res;
+}
+
+/*
+ * Phase 1: index the records of our range by the parser owning their client.
+ * Delimiters become NULs, so each record is terminated like getdelim()'s.
+ */
+static void *parser_index(void *arg) {
+  struct SplitJob *job = (struct SplitJob *)arg;
+  struct Split *split = job->split;
+  char *it = split->data + split->starts[job->id];
+  char *end = split->data + split->starts[job->id + 1];
+  uint32_t count = 0;
+  int p;
+
+  for (p = 0; p < split->nparsers; p++)
+    split->refs[job->id * split->nparsers + p].len = 0;
+
+  while (it < end) {
+    char *delimiter = memchr(it, DELIMETER, end - it);
+    size_t len = delimiter != NULL ? (size_t)(delimiter - it) + 1 : (size_t)(end - it); /* The last one can be cut short */
+    uint32_t client_id;
+    struct Refs *refs;
+
+    /* Not counted by parser_record() either */
+    if (len < 5) {
+      it += len;
+      continue;
+    }
+
+    if (delimiter != NULL)
+      *delimiter = '\0';
+    client_id = parse_uint32(it);
+
+    /* Another replayer instance has it, don't bother */
+    if (!spool_owns(client_id)) {
+      it += len;
+      count++;
+      continue;
+    }
+
+    p = spool_hash(client_id) / spool_partitions() % split->nparsers;
+    refs = &split->refs[job->id * split->nparsers + p];
+
+    if (refs->len == refs->cap) {
+      refs->cap = refs->cap ? refs->cap * 2 : 1024;
+      refs->refs = realloc(refs->refs, refs->cap * sizeof(struct RecordRef));
+    }
+
+    refs->refs[refs->len].off = it - split->data;
+    refs->refs[refs->len].len = len;
+    refs->refs[refs->len].seq = count++;
+    refs->len++;
+
+    it += len;
+  }
+
+  split->counts[job->id] = count;
+  return NULL;
+}
+
+/*
+ * Phase 2: parse the records of our clients, range after range so they stay in order.
+ */
+static void *parser_parse(void *arg) {
+  struct SplitJob *job = (struct SplitJob *)arg;
+  struct Split *split = job->split;
+  struct Parser *parser = split->parsers[job->id];
+  uint64_t seq = split->seq;
+  size_t i;
+  int r;
+
+  for (r = 0; r < split->nparsers; r++) {
+    struct Refs *refs = &split->refs[r * split->nparsers + job->id];
+
+    for (i = 0; i < refs->len; i++) {
+      parser->seq = seq + refs->refs[i].seq;
+      parser_record(parser, split->data + refs->refs[i].off, refs->refs[i].len);
+    }
+
+    seq += split->counts[r];
+  }
+
+  return NULL;
+}
+
+static void split_run(struct Split *split, struct SplitJob *jobs, pthread_t *threads, void *(*phase)(void *)) {
+  int i;
+
+  for (i = 0; i < split->nparsers; i++)
+    pthread_create(&threads[i], NULL, phase, &jobs[i]);
+}
+
+static void split_join(struct Split *split, pthread_t *threads) {
+  int i;
+
+  for (i = 0; i < split->nparsers; i++)
+    pthread_join(threads[i], NULL);
+}
+
+/*
+ * Fill buf after the len bytes already there, returns the new length.
+ */
+static size_t window_read(FILE *f, char **buf, size_t *cap, size_t len) {
+  size_t n;
+
+  while ((n = fread(*buf + len, 1, *cap - len, f)) > 0) {
+    len += n;
+
+    if (len < *cap)
+      continue;
+
+    /* A record bigger than the window, make room */
+    if (memchr(*buf, DELIMETER, len) == NULL) {
+      *cap *= 2;
+      *buf = realloc(*buf, *cap + 1);
+      continue;
+    }
+
+    break;
+  }
+
+  return len;
+}
+
+/*
+ * Parse a whole segment with several parsers.
+ *
+ * The segment is read (and decompressed) once, a window at a time, into our
+ * own buffer. Each window is split into byte ranges at record boundaries,
+ * each parser indexes one of them by client, then parses the records of its
+ * clients from every range in order, in place. Meanwhile we read the next
+ * window. The packets of a client are parsed in order by the same parser.
+ */
+int parser_run_all(struct Parser **parsers, int nparsers, const char *fn) {
+  struct Segment segment;
+  struct Split split;
+  struct SplitJob *jobs;
+  pthread_t *threads;
+  FILE *f;
+  char *bufs[2];
+  size_t caps[2] = { WINDOW_SIZE, WINDOW_SIZE }, len;
+  uint64_t seq = parsers[0]->seq;
+  int i, res, cur = 0, parsing = 0;
+
+  if (nparsers == 1)
+    return parser_run(parsers[0], fn);
+
+  f = segment_open(&segment, fn);
+
+  if (f == NULL) {
+    log_info("[Main] Could not open packet log");
+    return 1;
+  }
+
+  memset(&split, 0, sizeof(split));
+  split.parsers = parsers;
+  split.nparsers = nparsers;
+  split.starts = calloc(nparsers + 1, sizeof(size_t));
+  split.counts = calloc(nparsers, sizeof(uint32_t));
+  split.refs = calloc(nparsers * nparsers, sizeof(struct Refs));
+
+  jobs = calloc(nparsers, sizeof(struct SplitJob));
+  threads = calloc(nparsers, sizeof(pthread_t));
+
+  for (i = 0; i < nparsers; i++) {
+    jobs[i].split = &split;
+    jobs[i].id = i;
+  }
+
+  /* One window is parsed while we read the other, +1 for a NUL after the last record */
+  bufs[0] = malloc(caps[0] + 1);
+  bufs[1] = malloc(caps[1] + 1);
+
+  len = window_read(f, &bufs[cur], &caps[cur], 0);
+
+  while (len > 0) {
+    char *data = bufs[cur];
+    size_t end, tail;
+
+    /* Up to the last complete record, the rest starts the next window. The last one has it all. */
+    end = len < caps[cur] ? len : (size_t)((char *)memrchr(data, DELIMETER, len) - data) + 1;
+    data[end] = '\0';
+
+    /* The previous window is done, its buffer is ours again */
+    if (parsing) {
+      split_join(&split, threads);
+      for (i = 0; i < nparsers; i++)
+        seq += split.counts[i];
+    }
+
+    /* Range bounds, right after a delimiter */
+    split.starts[0] = 0;
+    for (i = 1; i < nparsers; i++) {
+      size_t start = end * i / nparsers;
+      char *delimiter;
+
+      if (start <= split.starts[i - 1]) {
+        split.starts[i] = split.starts[i - 1];
+        continue;
+      }
+
+      delimiter = memchr(data + start - 1, DELIMETER, end - start + 1);
+      split.starts[i] = delimiter != NULL ? (size_t)(delimiter - data) + 1 : end;
+    }
+    split.starts[nparsers] = end;
+
+    split.data = data;
+    split.seq = seq;
+
+    split_run(&split, jobs, threads, parser_index);
+    split_join(&split, threads);
+
+    split_run(&split, jobs, threads, parser_parse);
+    parsing = 1;
+
+    tail = len - end;
+    if (tail > caps[!cur]) {
+      caps[!cur] = tail * 2;
+      bufs[!cur] = realloc(bufs[!cur], caps[!cur] + 1);
+    }
+    memcpy(bufs[!cur], data + end, tail);
+
+    cur = !cur;
+    len = window_read(f, &bufs[cur], &caps[cur], tail);
+  }
+
+  if (parsing) {
+    split_join(&split, threads);
+    for (i = 0; i < nparsers; i++)
+      seq += split.counts[i];
+  }
+
+  for (i = 0; i < nparsers * nparsers; i++)
+    free(split.refs[i].refs);
+
+  free(split.refs);
+  free(split.counts);
+  free(split.starts);
+  free(jobs);
+  free(threads);
+  free(bufs[0]);
+  free(bufs[1]);
+  res = segment_close(&segment);
+
+  /* Every parser is at the end of the segment */
+  for (i = 0; i < nparsers; i++) {
+    parsers[i]->seq = seq;
+    parser_finish(parsers[i]);
+  }
+
+  return res;
+}
+
+void parser_reset(struct Parser *parser) {
+  parser->sent = parser->dropped = parser->source = parser->orphaned = 0;
+}
+
+void parser_free(struct Parser *parser) {
+  free(parser);
+}
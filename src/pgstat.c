@@ -0,0 +1,481 @@
+/*
+ * Server side statistics: pg_stat_statements, pg_stat_database and pg_stat_bgwriter.
+ */
+
+#define _GNU_SOURCE
+
+#include <libpq-fe.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "pgstat.h"
+#include "helpers.h"
+#include "replayer.h"
+#include "fingerprint.h"
+
+#define SHAPES_SIZE 4096 /* Power of 2 */
+#define TOP_SHAPES 10
+#define QUERY_SAMPLE 60
+
+/*
+ * What the workers saw for one query shape since the last snapshot.
+ */
+struct ClientShape {
+  uint64_t key; /* fingerprint, 0 is free */
+  uint64_t count, queue_usec, latency_usec;
+};
+
+/*
+ * One pg_stat_statements entry.
+ */
+struct ServerStatement {
+  int64_t queryid;
+  uint64_t fingerprint;
+  uint64_t calls, rows;
+  double exec_ms;
+  char query[QUERY_SAMPLE + 1];
+};
+
+struct Snapshot {
+  struct ServerStatement *statements; /* Sorted by queryid */
+  size_t len;
+
+  /* pg_stat_database */
+  uint64_t commits, rollbacks, blks_read, blks_hit;
+  uint64_t returned, fetched, inserted, updated, deleted, deadlocks, temp_bytes;
+
+  /* pg_stat_bgwriter, or pg_stat_checkpointer since 17 */
+  uint64_t checkpoints_timed, checkpoints_req, buffers_checkpoint, buffers_clean, buffers_backend;
+};
+
+/* Per shape difference between two snapshots, joined with the client side */
+struct ShapeDelta {
+  uint64_t fingerprint;
+  uint64_t count, queue_usec, latency_usec;
+  uint64_t calls;
+  double exec_ms;
+  const char *query;
+};
+
+static PGconn *conn = NULL;
+static int has_pgss = 0;
+static struct Snapshot last;
+static int has_last = 0;
+
+static struct ClientShape shapes[SHAPES_SIZE];
+static uint64_t untracked = 0;
+
+/* The collector takes the snapshots so the dispatch thread never waits on the server */
+static pthread_t collector;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int collector_running = 0, pending = 0, stopping = 0;
+
+int pgstat_enabled(void) {
+  return conn != NULL;
+}
+
+static int pgstat_take(struct Snapshot *snapshot);
+static void *pgstat_collector(void *arg);
+
+int pgstat_init(void) {
+  char *url = getenv("SERVER_STATS_URL");
+  PGresult *res;
+
+  if (url == NULL)
+    return 0;
+
+  conn = PQconnectdb(url);
+
+  if (PQstatus(conn) != CONNECTION_OK) {
+    log_info("[PgStat] Could not connect: %s", PQerrorMessage(conn));
+    PQfinish(conn);
+    conn = NULL;
+    return -1;
+  }
+
+  res = PQexec(conn, "SELECT 1 FROM pg_extension WHERE extname = 'pg_stat_statements'");
+  has_pgss = PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1;
+  PQclear(res);
+
+  if (!has_pgss)
+    log_info("[PgStat] pg_stat_statements is not installed, collecting pg_stat_database and pg_stat_bgwriter only");
+
+  log_info("[PgStat] Collecting server statistics, server version %d", PQserverVersion(conn));
+
+  /* Baseline */
+  memset(&last, 0, sizeof(last));
+  has_last = pgstat_take(&last) == 0;
+
+  pthread_create(&collector, NULL, pgstat_collector, NULL);
+  collector_running = 1;
+
+  return 0;
+}
+
+/*
+ * Workers
+ */
+void pgstat_record(uint64_t fingerprint, uint64_t queue_usec, uint64_t latency_usec) {
+  uint64_t key = fingerprint ? fingerprint : 1;
+  size_t i, n;
+
+  if (conn == NULL || !has_pgss)
+    return;
+
+  for (i = key & (SHAPES_SIZE - 1), n = 0; n < SHAPES_SIZE; i = (i + 1) & (SHAPES_SIZE - 1), n++) {
+    uint64_t current = __atomic_load_n(&shapes[i].key, __ATOMIC_ACQUIRE);
+
+    if (current == 0) {
+      uint64_t expected = 0;
+
+      if (!__atomic_compare_exchange_n(&shapes[i].key, &expected, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        current = expected; /* Somebody beat us to it */
+      else
+        current = key;
+    }
+
+    if (current == key) {
+      __atomic_add_fetch(&shapes[i].count, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&shapes[i].queue_usec, queue_usec, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&shapes[i].latency_usec, latency_usec, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  /* Too many shapes */
+  __atomic_add_fetch(&untracked, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Snapshots
+ */
+static uint64_t value(PGresult *res, int row, int col) {
+  return PQgetisnull(res, row, col) ? 0 : strtoull(PQgetvalue(res, row, col), NULL, 10);
+}
+
+/* Run a query, NULL unless it returned at least columns columns. */
+static PGresult *query(const char *sql, int columns) {
+  PGresult *res = PQexec(conn, sql);
+
+  if (PQresultStatus(res) != PGRES_TUPLES_OK || PQnfields(res) < columns) {
+    log_info("[PgStat] %s | %s", sql, PQresultStatus(res) == PGRES_TUPLES_OK ? "unexpected result" : PQerrorMessage(conn));
+    PQclear(res);
+    return NULL;
+  }
+
+  return res;
+}
+
+static int statement_cmp(const void *a, const void *b) {
+  const struct ServerStatement *sa = a, *sb = b;
+  return (sa->queryid > sb->queryid) - (sa->queryid < sb->queryid);
+}
+
+static int pgstat_statements(struct Snapshot *snapshot) {
+  const char *sql = PQserverVersion(conn) >= 130000 ?
+    "SELECT queryid, calls, total_exec_time, rows, query FROM pg_stat_statements "
+    "WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database()) AND queryid IS NOT NULL" :
+    "SELECT queryid, calls, total_time, rows, query FROM pg_stat_statements "
+    "WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database()) AND queryid IS NOT NULL";
+  PGresult *res = query(sql, 5);
+  int i, n;
+
+  if (res == NULL)
+    return -1;
+
+  n = PQntuples(res);
+  snapshot->statements = calloc(n > 0 ? n : 1, sizeof(struct ServerStatement));
+  snapshot->len = n;
+
+  for (i = 0; i < n; i++) {
+    struct ServerStatement *statement = &snapshot->statements[i];
+    const char *text = PQgetvalue(res, i, 4);
+
+    statement->queryid = strtoll(PQgetvalue(res, i, 0), NULL, 10);
+    statement->calls = value(res, i, 1);
+    statement->exec_ms = strtod(PQgetvalue(res, i, 2), NULL);
+    statement->rows = value(res, i, 3);
+    statement->fingerprint = fingerprint(text);
+    strncpy(statement->query, text, QUERY_SAMPLE);
+  }
+
+  PQclear(res);
+  qsort(snapshot->statements, snapshot->len, sizeof(struct ServerStatement), statement_cmp);
+
+  return 0;
+}
+
+static int pgstat_database(struct Snapshot *snapshot) {
+  PGresult *res = query(
+    "SELECT xact_commit, xact_rollback, blks_read, blks_hit, tup_returned, tup_fetched, "
+    "tup_inserted, tup_updated, tup_deleted, deadlocks, temp_bytes "
+    "FROM pg_stat_database WHERE datname = current_database()", 11);
+
+  if (res == NULL || PQntuples(res) != 1) {
+    PQclear(res);
+    return -1;
+  }
+
+  snapshot->commits = value(res, 0, 0);
+  snapshot->rollbacks = value(res, 0, 1);
+  snapshot->blks_read = value(res, 0, 2);
+  snapshot->blks_hit = value(res, 0, 3);
+  snapshot->returned = value(res, 0, 4);
+  snapshot->fetched = value(res, 0, 5);
+  snapshot->inserted = value(res, 0, 6);
+  snapshot->updated = value(res, 0, 7);
+  snapshot->deleted = value(res, 0, 8);
+  snapshot->deadlocks = value(res, 0, 9);
+  snapshot->temp_bytes = value(res, 0, 10);
+
+  PQclear(res);
+  return 0;
+}
+
+static int pgstat_bgwriter(struct Snapshot *snapshot) {
+  /* Checkpoints moved to pg_stat_checkpointer and buffers_backend went away in 17 */
+  const char *sql = PQserverVersion(conn) >= 170000 ?
+    "SELECT c.num_timed, c.num_requested, c.buffers_written, b.buffers_clean, 0 "
+    "FROM pg_stat_checkpointer c, pg_stat_bgwriter b" :
+    "SELECT checkpoints_timed, checkpoints_req, buffers_checkpoint, buffers_clean, buffers_backend "
+    "FROM pg_stat_bgwriter";
+  PGresult *res = query(sql, 5);
+
+  if (res == NULL || PQntuples(res) != 1) {
+    PQclear(res);
+    return -1;
+  }
+
+  snapshot->checkpoints_timed = value(res, 0, 0);
+  snapshot->checkpoints_req = value(res, 0, 1);
+  snapshot->buffers_checkpoint = value(res, 0, 2);
+  snapshot->buffers_clean = value(res, 0, 3);
+  snapshot->buffers_backend = value(res, 0, 4);
+
+  PQclear(res);
+  return 0;
+}
+
+static int pgstat_take(struct Snapshot *snapshot) {
+  if (PQstatus(conn) != CONNECTION_OK) {
+    PQreset(conn);
+
+    if (PQstatus(conn) != CONNECTION_OK) {
+      log_info("[PgStat] Could not reconnect: %s", PQerrorMessage(conn));
+      return -1;
+    }
+  }
+
+  if (pgstat_database(snapshot) || pgstat_bgwriter(snapshot))
+    return -1;
+
+  if (has_pgss && pgstat_statements(snapshot))
+    return -1;
+
+  return 0;
+}
+
+static void snapshot_free(struct Snapshot *snapshot) {
+  free(snapshot->statements);
+  memset(snapshot, 0, sizeof(struct Snapshot));
+}
+
+/*
+ * Joining
+ */
+static struct ShapeDelta *delta_find(struct ShapeDelta *deltas, size_t cap, uint64_t fingerprint) {
+  size_t i;
+
+  for (i = fingerprint & (cap - 1); deltas[i].fingerprint != 0 && deltas[i].fingerprint != fingerprint; i = (i + 1) & (cap - 1))
+    ;
+
+  deltas[i].fingerprint = fingerprint;
+  return &deltas[i];
+}
+
+/* Most time spent by the replayer first */
+static int delta_cmp(const void *a, const void *b) {
+  const struct ShapeDelta *da = a, *db = b;
+  return (da->latency_usec < db->latency_usec) - (da->latency_usec > db->latency_usec);
+}
+
+static void pgstat_shapes(struct Snapshot *now) {
+  size_t cap = 1, i, j = 0, n = 0;
+  struct ShapeDelta *deltas;
+
+  /* Room for every server and client shape, at most half full */
+  while (cap < 2 * (now->len + SHAPES_SIZE))
+    cap <<= 1;
+
+  deltas = calloc(cap, sizeof(struct ShapeDelta));
+
+  /* Server: both snapshots are sorted by queryid, entries evicted since the last one are new */
+  for (i = 0; i < now->len; i++) {
+    struct ServerStatement *statement = &now->statements[i];
+    struct ShapeDelta *delta;
+    uint64_t calls = statement->calls;
+    double exec_ms = statement->exec_ms;
+
+    while (j < last.len && last.statements[j].queryid < statement->queryid)
+      j++;
+
+    if (j < last.len && last.statements[j].queryid == statement->queryid && last.statements[j].calls <= calls) {
+      calls -= last.statements[j].calls;
+      exec_ms -= last.statements[j].exec_ms;
+    }
+
+    if (calls == 0)
+      continue;
+
+    delta = delta_find(deltas, cap, statement->fingerprint ? statement->fingerprint : 1);
+    delta->calls += calls;
+    delta->exec_ms += exec_ms;
+    if (delta->query == NULL)
+      delta->query = statement->query;
+  }
+
+  /* Client */
+  for (i = 0; i < SHAPES_SIZE; i++) {
+    uint64_t key = __atomic_load_n(&shapes[i].key, __ATOMIC_ACQUIRE);
+    uint64_t count = __atomic_exchange_n(&shapes[i].count, 0, __ATOMIC_RELAXED);
+    struct ShapeDelta *delta;
+
+    if (key == 0 || count == 0)
+      continue;
+
+    delta = delta_find(deltas, cap, key);
+    delta->count += count;
+    delta->queue_usec += __atomic_exchange_n(&shapes[i].queue_usec, 0, __ATOMIC_RELAXED);
+    delta->latency_usec += __atomic_exchange_n(&shapes[i].latency_usec, 0, __ATOMIC_RELAXED);
+  }
+
+  /* Compact and sort */
+  for (i = 0; i < cap; i++)
+    if (deltas[i].fingerprint != 0)
+      deltas[n++] = deltas[i];
+
+  qsort(deltas, n, sizeof(struct ShapeDelta), delta_cmp);
+
+  for (i = 0; i < n && i < TOP_SHAPES; i++) {
+    struct ShapeDelta *delta = &deltas[i];
+    double queue = delta->count ? (double)delta->queue_usec / delta->count / 1000 : 0;
+    double client = delta->count ? (double)delta->latency_usec / delta->count / 1000 : 0;
+    double server = delta->calls ? delta->exec_ms / delta->calls : 0;
+
+    if (delta->count == 0)
+      break;
+
+    if (delta->calls == 0) {
+      log_info("[PgStat][Statistics] %016llx: Replayed: %llu; Queue: %.3f ms; Latency: %.3f ms; not in pg_stat_statements.",
+        delta->fingerprint, delta->count, queue, client);
+      continue;
+    }
+
+    log_info("[PgStat][Statistics] %016llx: Replayed: %llu; Queue: %.3f ms; Latency: %.3f ms; Server: %llu calls, %.3f ms; Network: %.3f ms. %s",
+      delta->fingerprint, delta->count, queue, client, delta->calls, server, client > server ? client - server : 0, delta->query);
+  }
+
+  if (__atomic_load_n(&untracked, __ATOMIC_RELAXED))
+    log_info("[PgStat][Statistics] Statements of untracked shapes: %llu.", __atomic_exchange_n(&untracked, 0, __ATOMIC_RELAXED));
+
+  free(deltas);
+}
+
+/*
+ * Counters go back to 0 when the statistics are reset or the server restarts,
+ * count from there like the statements do.
+ */
+static uint64_t diff(uint64_t now, uint64_t then) {
+  return now >= then ? now - then : now;
+}
+
+static void pgstat_collect(void) {
+  struct Snapshot now;
+  uint64_t blks;
+
+  memset(&now, 0, sizeof(now));
+
+  if (pgstat_take(&now)) {
+    snapshot_free(&now);
+    return;
+  }
+
+  /* First good snapshot, nothing to compare to */
+  if (!has_last) {
+    last = now;
+    has_last = 1;
+    return;
+  }
+
+  blks = diff(now.blks_read, last.blks_read) + diff(now.blks_hit, last.blks_hit);
+
+  log_info("[PgStat][Statistics] Database: Commits: %llu; Rollbacks: %llu; Blocks read: %llu; Hit ratio: %.2f%%; Tuples returned: %llu, fetched: %llu, inserted: %llu, updated: %llu, deleted: %llu; Deadlocks: %llu; Temp bytes: %llu.",
+    diff(now.commits, last.commits), diff(now.rollbacks, last.rollbacks), diff(now.blks_read, last.blks_read),
+    blks ? 100.0 * diff(now.blks_hit, last.blks_hit) / blks : 100.0,
+    diff(now.returned, last.returned), diff(now.fetched, last.fetched), diff(now.inserted, last.inserted),
+    diff(now.updated, last.updated), diff(now.deleted, last.deleted), diff(now.deadlocks, last.deadlocks),
+    diff(now.temp_bytes, last.temp_bytes));
+
+  log_info("[PgStat][Statistics] Checkpoints: %llu timed, %llu requested; Buffers written by checkpoints: %llu, bgwriter: %llu, backends: %llu.",
+    diff(now.checkpoints_timed, last.checkpoints_timed), diff(now.checkpoints_req, last.checkpoints_req),
+    diff(now.buffers_checkpoint, last.buffers_checkpoint), diff(now.buffers_clean, last.buffers_clean),
+    diff(now.buffers_backend, last.buffers_backend));
+
+  if (has_pgss)
+    pgstat_shapes(&now);
+
+  snapshot_free(&last);
+  last = now;
+}
+
+static void *pgstat_collector(void *arg) {
+  while (1) {
+    pthread_mutex_lock(&lock);
+    while (!pending && !stopping)
+      pthread_cond_wait(&wake, &lock);
+
+    if (stopping) {
+      pthread_mutex_unlock(&lock);
+      return NULL;
+    }
+
+    pending = 0;
+    pthread_mutex_unlock(&lock);
+
+    pgstat_collect();
+  }
+}
+
+/* Wake up the collector, requests made while it is busy make one more snapshot */
+void pgstat_snapshot(void) {
+  if (conn == NULL)
+    return;
+
+  pthread_mutex_lock(&lock);
+  pending = 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+}
+
+void pgstat_free(void) {
+  if (conn == NULL)
+    return;
+
+  if (collector_running) {
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(collector, NULL);
+    collector_running = 0;
+    stopping = 0;
+  }
+
+  snapshot_free(&last);
+  has_last = 0;
+  PQfinish(conn);
+  conn = NULL;
+}
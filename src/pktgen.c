@@ -0,0 +1,299 @@
+/*
+ * Generate a synthetic packet log, see PACKET_FILE.
+ *
+ * Usage: pktgen [options] <out>
+ *
+ *   -n statements   statements to generate (default 100000)
+ *   -c clients      distinct client ids (default 1000)
+ *   -i interleave   clients talking at the same time (default 64)
+ *   -e percent      statements using the extended protocol, P/B/E, instead of Q (default 80)
+ *   -r percent      reads, the rest are writes (default 80)
+ *   -p params       up to this many parameters per statement (default 4)
+ *   -s bytes        size of each parameter (default 8)
+ *   -t tables       distinct tables, i.e. query shapes per kind (default 16)
+ *   -S seed         random seed (default 1)
+ *
+ * Records are in the v1 format the player reads: client id, tag, length,
+ * then the message, followed by the delimiter. Client ids and lengths are
+ * chosen so they never contain the delimiter, every record parses.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "replayer.h"
+#include "parser.h"
+
+int DEBUG = 0;
+
+#define MAX_PARAMS 64
+#define MAX_PARAM_SIZE 4096
+
+/* What each client does next */
+enum Step {
+  STEP_IDLE,
+  STEP_BIND,
+  STEP_EXECUTE,
+};
+
+struct Slot {
+  uint32_t client_id;
+  enum Step step;
+  int np;
+};
+
+static int n_clients = 1000, interleave = 64, extended = 80, reads = 80, max_params = 4, param_size = 8, tables = 16;
+
+static char query[MAX_PARAMS * (MAX_PARAM_SIZE + 32) + 256];
+static char param[MAX_PARAM_SIZE + 1];
+
+static void put_uint32(FILE *f, uint32_t value) {
+  unsigned char buf[4] = { value >> 24, value >> 16, value >> 8, value };
+  fwrite(buf, 1, 4, f);
+}
+
+static void put_uint16(FILE *f, uint16_t value) {
+  unsigned char buf[2] = { value >> 8, value };
+  fwrite(buf, 1, 2, f);
+}
+
+/* Would this split the record? */
+static int has_delimiter(uint32_t value) {
+  int i;
+
+  for (i = 0; i < 4; i++)
+    if (((value >> (i * 8)) & 0xff) == DELIMETER)
+      return 1;
+
+  return 0;
+}
+
+/* Pad the query until its length is safe */
+static void pad_query(uint32_t extra) {
+  while (has_delimiter(strlen(query) + 1 + extra + 4))
+    strcat(query, " ");
+}
+
+static void record_begin(FILE *f, uint32_t client_id, char tag, uint32_t len) {
+  put_uint32(f, client_id);
+  fputc(tag, f);
+  put_uint32(f, len + 4); /* Includes itself, like the protocol */
+}
+
+static void record_end(FILE *f) {
+  fputc(DELIMETER, f);
+}
+
+static void random_param(void) {
+  static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+  int i;
+
+  for (i = 0; i < param_size; i++)
+    param[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+  param[param_size] = '\0';
+}
+
+/*
+ * A read or write on a random table, with $n placeholders or literals.
+ */
+static void random_query(int np, int literals) {
+  int i, table = rand() % tables, read = rand() % 100 < reads;
+  size_t len;
+
+  if (read)
+    len = sprintf(query, "SELECT id, name, created_at FROM bench_%d WHERE ", table);
+  else
+    len = sprintf(query, "UPDATE bench_%d SET updated_at = now() WHERE ", table);
+
+  for (i = 0; i < np; i++) {
+    if (i > 0)
+      len += sprintf(query + len, " AND ");
+
+    if (literals) {
+      random_param();
+      len += sprintf(query + len, "c%d = '%s'", i, param);
+    }
+    else
+      len += sprintf(query + len, "c%d = $%d", i, i + 1);
+  }
+}
+
+static void simple_query(FILE *f, uint32_t client_id, int np) {
+  random_query(np, 1);
+  pad_query(0);
+
+  record_begin(f, client_id, 'Q', strlen(query) + 1);
+  fwrite(query, 1, strlen(query) + 1, f);
+  record_end(f);
+}
+
+static void parse(FILE *f, uint32_t client_id, int np) {
+  random_query(np, 0);
+  pad_query(1 + 2);
+
+  /* Unnamed statement */
+  record_begin(f, client_id, 'P', 1 + strlen(query) + 1 + 2);
+  fputc('\0', f);
+  fwrite(query, 1, strlen(query) + 1, f);
+  put_uint16(f, 0); /* No parameter types */
+  record_end(f);
+}
+
+static void bind(FILE *f, uint32_t client_id, int np) {
+  uint32_t len = 1 + 1 + 2 + 2 + np * (4 + param_size) + 2 + 2;
+  int i, nf = 0;
+
+  /* No formats and one format both mean text, pick a safe length */
+  if (has_delimiter(len + 4))
+    nf = 1;
+
+  record_begin(f, client_id, 'B', len + nf * 2);
+  fputc('\0', f); /* Portal */
+  fputc('\0', f); /* Statement */
+  put_uint16(f, nf);
+  if (nf)
+    put_uint16(f, 0);
+  put_uint16(f, np);
+
+  for (i = 0; i < np; i++) {
+    random_param();
+    put_uint32(f, param_size);
+    fwrite(param, 1, param_size, f);
+  }
+
+  put_uint16(f, 1); /* Text results */
+  put_uint16(f, 0);
+  record_end(f);
+}
+
+static void execute(FILE *f, uint32_t client_id) {
+  record_begin(f, client_id, 'E', 1 + 4);
+  fputc('\0', f); /* Portal */
+  put_uint32(f, 0); /* All rows */
+  record_end(f);
+}
+
+/*
+ * Clients of a slot are congruent to it modulo interleave,
+ * so a client is never in two slots at once. Written in base 255
+ * skipping the delimiter, so ids stay distinct and safe.
+ */
+static uint32_t random_client(int slot) {
+  int per_slot = n_clients / interleave, i;
+  uint32_t n = 1 + slot + interleave * (rand() % per_slot), client_id = 0;
+
+  for (i = 0; i < 4; i++) {
+    uint32_t digit = n % 255;
+    n /= 255;
+    client_id |= (digit >= DELIMETER ? digit + 1 : digit) << (i * 8);
+  }
+
+  return client_id;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n statements] [-c clients] [-i interleave] [-e extended %%] [-r reads %%] [-p params] [-s param size] [-t tables] [-S seed] <out>\n", name);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  struct Slot *slots;
+  long statements = 100000, started = 0, finished = 0;
+  unsigned seed = 1;
+  FILE *f;
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "n:c:i:e:r:p:s:t:S:")) != -1) {
+    switch (opt) {
+      case 'n': statements = atol(optarg); break;
+      case 'c': n_clients = atoi(optarg); break;
+      case 'i': interleave = atoi(optarg); break;
+      case 'e': extended = atoi(optarg); break;
+      case 'r': reads = atoi(optarg); break;
+      case 'p': max_params = atoi(optarg); break;
+      case 's': param_size = atoi(optarg); break;
+      case 't': tables = atoi(optarg); break;
+      case 'S': seed = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1)
+    usage(argv[0]);
+
+  if (n_clients < 1 || interleave < 1 || tables < 1 || max_params < 1 || max_params > MAX_PARAMS || param_size < 1 || param_size > MAX_PARAM_SIZE) {
+    fprintf(stderr, "Invalid option, need at least one client, table and parameter; at most %d parameters of %d bytes\n", MAX_PARAMS, MAX_PARAM_SIZE);
+    return 2;
+  }
+
+  if (has_delimiter(param_size)) {
+    fprintf(stderr, "Parameter size %d contains the delimiter, use another one\n", param_size);
+    return 2;
+  }
+
+  if (interleave > n_clients)
+    interleave = n_clients;
+
+  if ((f = fopen(argv[optind], "w")) == NULL) {
+    fprintf(stderr, "Could not write %s\n", argv[optind]);
+    return 1;
+  }
+
+  srand(seed);
+  slots = calloc(interleave, sizeof(struct Slot));
+
+  for (i = 0; i < interleave; i++)
+    slots[i].client_id = random_client(i);
+
+  /* Each step advances one random client by one packet */
+  while (finished < statements) {
+    int s = rand() % interleave;
+    struct Slot *slot = &slots[s];
+
+    switch (slot->step) {
+      case STEP_IDLE:
+        if (started >= statements)
+          break;
+
+        started++;
+        slot->np = 1 + rand() % max_params;
+
+        if (rand() % 100 < extended) {
+          parse(f, slot->client_id, slot->np);
+          slot->step = STEP_BIND;
+        }
+        else {
+          simple_query(f, slot->client_id, slot->np);
+          slot->client_id = random_client(s);
+          finished++;
+        }
+        break;
+
+      case STEP_BIND:
+        bind(f, slot->client_id, slot->np);
+        slot->step = STEP_EXECUTE;
+        break;
+
+      case STEP_EXECUTE:
+        execute(f, slot->client_id);
+        slot->step = STEP_IDLE;
+        slot->client_id = random_client(s);
+        finished++;
+        break;
+    }
+  }
+
+  free(slots);
+
+  if (fclose(f) != 0) {
+    fprintf(stderr, "Could not write %s\n", argv[optind]);
+    return 1;
+  }
+
+  return 0;
+}
@@ -15,62 +15,556 @@
 #include <string.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include "replayer.h"
 #include "statement.h"
 #include "helpers.h"
+#include "fingerprint.h"
+#include "results.h"
+#include "timeouts.h"
+#include "inflight.h"
+#include "classify.h"
+#include "pgstat.h"
+
+#define DEFAULT_POOL_SIZE 20
+#define MAX_POOL_SIZE 512
+#define MAX_TARGETS 8
+
+/*
+ * What to do when one target can't keep up with the others.
+ *
+ * Lockstep: block the main thread until every target accepted the statement,
+ * so all targets replay the same traffic at the pace of the slowest one. Only
+ * a full queue blocks, so targets can drift apart by what a queue holds: a
+ * pipe, 8192 statements with the default 64 KiB pipe buffer on Linux.
+ *
+ * Independent: never wait on a target, skip the statement for the target whose
+ * queue is full and count it.
+ */
+enum ReplayPolicy {
+  POLICY_LOCKSTEP,
+  POLICY_INDEPENDENT,
+};
+
+struct Worker {
+  struct Pool *pool;
+  int id;
+  PGconn *conn;
+
+  /* Watched by the watchdog, see postgres_watchdog() */
+  pthread_mutex_t lock;
+  pthread_cond_t cancel_sent;
+  PGcancel *cancel;
+  uint64_t deadline; /* Monotonic, in microseconds, 0 when idle */
+  int cancelled;
+  int cancelling; /* The watchdog is using cancel, without the lock */
+
+  int running; /* Connected and reading the queue */
+  int joinable; /* Thread not joined yet, it could have exited */
+};
+
+#define WATCHDOG_INTERVAL 10000 /* 10ms */
+#define MAX_POOLS 8 /* Primary and replicas */
+
+#define RECONNECT_INTERVAL 500000 /* 500ms */
+#define MONITOR_INTERVAL 1 /* Seconds */
+#define CONTROLLER_INTERVAL 1 /* Seconds */
+#define GROW_UTILIZATION 0.9 /* Busy share of the connections, see postgres_resize() */
+#define SHRINK_UTILIZATION 0.5
+
+/*
+ * Connections to one database server, with their own queue.
+ */
+struct Pool {
+  struct Target *target;
+  int id; /* 0 is the primary */
+  char *url;
+  char *host; /* For the logs */
+  pthread_t threads[MAX_POOL_SIZE];
+  struct Worker workers[MAX_POOL_SIZE];
+  int slots; /* Workers ever started, running or not */
+  int size; /* Workers running */
+  int retiring; /* Workers asked to exit */
+  int pipes[2];
+  PGconn *monitor; /* Replication lag checks, replicas only */
+  int64_t lag; /* Replication lag in microseconds, -1 if unknown, see postgres_monitor() */
+  uint64_t in_flight; /* Assigned but not finished */
+  uint64_t busy; /* Microseconds spent executing, reset by the controller */
+  uint64_t sent;
+};
+
+/*
+ * A database we replay against, a primary and optionally its replicas.
+ * Reads are spread over the replicas, writes go to the primary.
+ */
+struct Target {
+  int id;
+  struct Pool pools[MAX_POOLS];
+  int npools;
+  struct ResultWriter *results; /* NULL unless RESULTS_FILE is set */
+  uint64_t ok, not_ok, ignored, skipped, timeouts, reconnects;
+  uint64_t rows, bytes; /* Received from the database */
+};
+
+/*
+ * Outcome of one statement.
+ */
+struct Execution {
+  ExecStatusType status;
+  uint32_t rows;
+  uint64_t bytes;
+  uint64_t hash; /* Only computed when recording results */
+  char sqlstate[5];
+};
 
-#define POOL_SIZE 20
 /*
  * Multiplex connections.
  */
-static PGconn *conns[POOL_SIZE] = { NULL };
-static pthread_t threads[POOL_SIZE];
-static int thread_ids[POOL_SIZE];
-static int pipes[2] = { 0 };
-static uint64_t ok = 0, not_ok = 0, ignored = 0;
+static struct Target targets[MAX_TARGETS];
+static int ntargets = 0;
+static enum ReplayPolicy policy = POLICY_LOCKSTEP;
+static int pool_size = DEFAULT_POOL_SIZE;
+static int pool_min = 1, pool_max = MAX_POOL_SIZE; /* Adaptive sizing when they differ */
+static pthread_t watchdog, controller, monitor;
+static int watchdog_running = 0, controller_running = 0, monitor_running = 0;
 
 static int ignore_transction_blocks(char *stmt);
 
+static int postgres_target_init(struct Target *target, char *spec);
+static int postgres_pool_init(struct Pool *pool);
+static int postgres_worker_start(struct Pool *pool, int i);
+static void postgres_reconnect(struct Worker *worker);
+static void *postgres_controller(void *arg);
+static void postgres_cancel_wait(struct Worker *worker);
+static void *postgres_monitor(void *arg);
+static struct Pool *postgres_route(struct Target *target, struct PStatement *stmt, int *kind);
 static void *postgres_worker(void *arg);
-static void postgres_pexec(struct PStatement *stmt, PGconn *conn);
+static void *postgres_watchdog(void *arg);
+static void postgres_release(struct PStatement *stmt);
+static void postgres_pexec(struct PStatement *stmt, struct Worker *worker);
+static int postgres_results_init(void);
+static void postgres_consume(struct PStatement *stmt, struct Target *target, PGconn *conn, struct Execution *exec);
+static uint64_t postgres_consume_row(PGresult *res, uint64_t *hash);
 
 /*
- * Initialize the pool.
+ * Initialize the pool, POOL_SIZE * scale connections per database.
+ *
+ * With POOL_MIN and POOL_MAX apart, the controller resizes every pool
+ * between them, also times scale, depending on how busy its connections are.
+ *
+ * DATABASE_URL can hold several databases separated by ';', the same
+ * traffic is replayed against each one of them. Each database can have
+ * replicas, separated by '|', e.g. "postgres://primary/db|postgres://replica/db".
  */
-int postgres_init(void) {
-  int i;
+int postgres_init(int scale) {
   char *database_url = getenv("DATABASE_URL");
+  char *replay_policy = getenv("REPLAY_POLICY");
+  char *urls, *url, *saveptr = NULL;
+  int i;
 
   if (!database_url) {
     log_info("No DATABASE_URL is set but is required.");
     return -1;
   }
 
-  if (pipe(pipes) == -1) {
+  pool_size = (getenv("POOL_SIZE") != NULL ? atoi(getenv("POOL_SIZE")) : DEFAULT_POOL_SIZE) * scale;
+
+  if (pool_size < 1)
+    pool_size = 1;
+
+  if (pool_size > MAX_POOL_SIZE) {
+    log_info("Pool of %d connections is too big, using %d", pool_size, MAX_POOL_SIZE);
+    pool_size = MAX_POOL_SIZE;
+  }
+
+  /* The bounds grow with the virtual clients like the pool does */
+  pool_min = getenv("POOL_MIN") != NULL ? atoi(getenv("POOL_MIN")) * scale : pool_size;
+  pool_max = getenv("POOL_MAX") != NULL ? atoi(getenv("POOL_MAX")) * scale : pool_size;
+
+  if (pool_min < 1)
+    pool_min = 1;
+  if (pool_max > MAX_POOL_SIZE)
+    pool_max = MAX_POOL_SIZE;
+
+  if (pool_min > pool_max) {
+    log_info("POOL_MIN %d is above POOL_MAX %d", pool_min, pool_max);
+    return -1;
+  }
+
+  if (pool_size < pool_min)
+    pool_size = pool_min;
+  if (pool_size > pool_max)
+    pool_size = pool_max;
+
+  if (replay_policy != NULL && strcmp(replay_policy, "independent") == 0) {
+    policy = POLICY_INDEPENDENT;
+  }
+  else if (replay_policy != NULL && strcmp(replay_policy, "lockstep") != 0) {
+    log_info("Unknown REPLAY_POLICY %s, using lockstep", replay_policy);
+  }
+
+  urls = strdup(database_url);
+
+  for (url = strtok_r(urls, ";", &saveptr); url != NULL; url = strtok_r(NULL, ";", &saveptr)) {
+    /* Allow "url1; url2" */
+    while (*url == ' ')
+      url++;
+
+    if (*url == '\0')
+      continue;
+
+    if (ntargets == MAX_TARGETS) {
+      log_info("Too many databases in DATABASE_URL, max is %d", MAX_TARGETS);
+      free(urls);
+      return -1;
+    }
+
+    struct Target *target = &targets[ntargets];
+    target->id = ntargets;
+    ntargets++;
+
+    if (postgres_target_init(target, url)) {
+      free(urls);
+      return -1;
+    }
+  }
+
+  free(urls);
+
+  if (ntargets == 0) {
+    log_info("DATABASE_URL has no databases in it.");
+    return -1;
+  }
+
+  if (postgres_results_init()) {
+    return -1;
+  }
+
+  if (timeouts_init()) {
+    return -1;
+  }
+
+  if (timeouts_enabled()) {
+    pthread_create(&watchdog, NULL, postgres_watchdog, NULL);
+    watchdog_running = 1;
+  }
+
+  if (pool_min < pool_max) {
+    log_info("Resizing pools between %d and %d connections", pool_min, pool_max);
+    pthread_create(&controller, NULL, postgres_controller, NULL);
+    controller_running = 1;
+  }
+
+  for (i = 0; i < ntargets && !monitor_running; i++) {
+    if (targets[i].npools > 1) {
+      pthread_create(&monitor, NULL, postgres_monitor, NULL);
+      monitor_running = 1;
+    }
+  }
+
+  if (ntargets > 1) {
+    log_info("Replaying against %d databases, %s policy", ntargets,
+      policy == POLICY_LOCKSTEP ? "lockstep" : "independent");
+  }
+
+  return 0;
+}
+
+/*
+ * Connect the primary and replicas of one target.
+ */
+static int postgres_target_init(struct Target *target, char *spec) {
+  char *url, *saveptr = NULL;
+
+  for (url = strtok_r(spec, "|", &saveptr); url != NULL; url = strtok_r(NULL, "|", &saveptr)) {
+    while (*url == ' ')
+      url++;
+
+    if (*url == '\0')
+      continue;
+
+    if (target->npools == MAX_POOLS) {
+      log_info("[%d] Too many replicas, max is %d", target->id, MAX_POOLS - 1);
+      return -1;
+    }
+
+    struct Pool *pool = &target->pools[target->npools];
+    pool->target = target;
+    pool->id = target->npools;
+    pool->url = strdup(url);
+    target->npools++;
+
+    if (postgres_pool_init(pool))
+      return -1;
+  }
+
+  if (target->npools == 0) {
+    log_info("[%d] No database URL", target->id);
+    return -1;
+  }
+
+  if (target->npools > 1)
+    log_info("[%d] Routing reads to %d replicas", target->id, target->npools - 1);
+
+  return 0;
+}
+
+/*
+ * Connect one pool and start its workers.
+ */
+static int postgres_pool_init(struct Pool *pool) {
+  int i, t = pool->target->id;
+
+  if (pipe(pool->pipes) == -1) {
     log_info("pipe\n");
     exit(1);
   }
 
-  log_info("Creating a pool of %d connections", POOL_SIZE);
+  /* Don't let a slow target block the others */
+  if (policy == POLICY_INDEPENDENT) {
+    fcntl(pool->pipes[1], F_SETFL, fcntl(pool->pipes[1], F_GETFL) | O_NONBLOCK);
+  }
+
+  log_info("[%d][%d] Creating a pool of %d connections", t, pool->id, pool_size);
+
+  for (i = 0; i < pool_size; i++) {
+    if (postgres_worker_start(pool, i))
+      return -1;
+  }
 
-  for (i = 0; i < POOL_SIZE; i++) {
-    assert(conns[i] == NULL);
+  /* Replicas get one more connection to check replication lag */
+  pool->lag = -1;
 
-    PGconn *conn = PQconnectdb(database_url);
+  if (pool->id > 0) {
+    pool->monitor = PQconnectdb(pool->url);
 
-    if (PQstatus(conn) == CONNECTION_BAD) {
-      log_info("Connection to database failed: %s", PQerrorMessage(conn));
-      PQfinish(conn);
+    if (PQstatus(pool->monitor) == CONNECTION_BAD) {
+      log_info("[%d][%d] Connection to database failed: %s", t, pool->id, PQerrorMessage(pool->monitor));
+      PQfinish(pool->monitor);
+      pool->monitor = NULL;
       return -1;
     }
+  }
 
-    conns[i] = conn;
+  return 0;
+}
 
-    /* Initialize the threads */
-    thread_ids[i] = i;
+/*
+ * Connect a worker in slot i and start its thread.
+ */
+static int postgres_worker_start(struct Pool *pool, int i) {
+  struct Worker *worker = &pool->workers[i];
+  PGconn *conn;
+
+  assert(!worker->running);
+
+  conn = PQconnectdb(pool->url);
+
+  if (PQstatus(conn) == CONNECTION_BAD) {
+    log_info("[%d][%d] Connection to database failed: %s", pool->target->id, pool->id, PQerrorMessage(conn));
+    PQfinish(conn);
+    return -1;
+  }
+
+  if (pool->host == NULL)
+    pool->host = strdup(PQhost(conn) != NULL ? PQhost(conn) : "");
 
-    pthread_create(&threads[i], NULL, postgres_worker, &thread_ids[i]);
+  /* Reuse the slot of a worker that retired */
+  if (worker->joinable) {
+    pthread_join(pool->threads[i], NULL);
+    worker->joinable = 0;
+  }
+
+  if (i >= pool->slots) {
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cancel_sent, NULL);
+  }
+
+  pthread_mutex_lock(&worker->lock);
+  worker->pool = pool;
+  worker->id = i;
+  worker->conn = conn;
+  worker->cancel = PQgetCancel(conn);
+  worker->deadline = 0;
+  worker->cancelled = 0;
+  __atomic_store_n(&worker->running, 1, __ATOMIC_SEQ_CST);
+  worker->joinable = 1;
+  pthread_mutex_unlock(&worker->lock);
+
+  /* The watchdog looks at the slot from now on */
+  if (i >= pool->slots)
+    __atomic_store_n(&pool->slots, i + 1, __ATOMIC_SEQ_CST);
+
+  __atomic_add_fetch(&pool->size, 1, __ATOMIC_SEQ_CST);
+  pthread_create(&pool->threads[i], NULL, postgres_worker, worker);
+
+  return 0;
+}
+
+/*
+ * Take one of the exit requests of the pool, if there's any.
+ */
+static int postgres_retire(struct Worker *worker) {
+  struct Pool *pool = worker->pool;
+  int retiring = __atomic_load_n(&pool->retiring, __ATOMIC_SEQ_CST);
+
+  do {
+    if (retiring == 0)
+      return 0;
+  } while (!__atomic_compare_exchange_n(&pool->retiring, &retiring, retiring - 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+  pthread_mutex_lock(&worker->lock);
+  postgres_cancel_wait(worker);
+  PQfreeCancel(worker->cancel);
+  worker->cancel = NULL;
+  __atomic_store_n(&worker->running, 0, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&worker->lock);
+
+  PQfinish(worker->conn);
+  worker->conn = NULL;
+
+  __atomic_sub_fetch(&pool->size, 1, __ATOMIC_SEQ_CST);
+
+  if (DEBUG)
+    log_info("[%d][%d] Worker %d retired", pool->target->id, pool->id, worker->id);
+
+  return 1;
+}
+
+/*
+ * Connect again after losing the connection, every RECONNECT_INTERVAL until it works.
+ *
+ * Statements wait in the queue meanwhile instead of failing one after
+ * the other, so a restart of the server doesn't eat the packet log.
+ */
+static void postgres_reconnect(struct Worker *worker) {
+  struct Pool *pool = worker->pool;
+  int attempts = 0;
+
+  for (;;) {
+    PQreset(worker->conn);
+
+    if (PQstatus(worker->conn) == CONNECTION_OK)
+      break;
+
+    if (attempts++ == 0)
+      log_info("[Postgres][%d][%d][%d] Connection lost, reconnecting: %s", pool->target->id, pool->id, worker->id, PQerrorMessage(worker->conn));
+
+    usleep(RECONNECT_INTERVAL);
+  }
+
+  /* The old cancel key is for the old backend */
+  pthread_mutex_lock(&worker->lock);
+  postgres_cancel_wait(worker);
+  PQfreeCancel(worker->cancel);
+  worker->cancel = PQgetCancel(worker->conn);
+  pthread_mutex_unlock(&worker->lock);
+
+  __atomic_add_fetch(&pool->target->reconnects, 1, __ATOMIC_SEQ_CST);
+  log_info("[Postgres][%d][%d][%d] Reconnected after %d failed attempts", pool->target->id, pool->id, worker->id, attempts);
+}
+
+/*
+ * Grow the pool when statements are waiting for busy connections,
+ * shrink it when connections are mostly idle and nothing is waiting.
+ *
+ * Utilization is the share of the last interval the connections spent
+ * executing statements.
+ */
+static void postgres_resize(struct Pool *pool, uint64_t elapsed) {
+  int size = __atomic_load_n(&pool->size, __ATOMIC_SEQ_CST) - __atomic_load_n(&pool->retiring, __ATOMIC_SEQ_CST);
+  uint64_t busy = __atomic_exchange_n(&pool->busy, 0, __ATOMIC_SEQ_CST);
+  uint64_t in_flight = __atomic_load_n(&pool->in_flight, __ATOMIC_SEQ_CST);
+  uint64_t queued = in_flight > (uint64_t)size ? in_flight - size : 0;
+  double utilization = size > 0 && elapsed > 0 ? (double)busy / ((double)elapsed * size) : 1;
+  struct PStatement *null = NULL;
+  int want = size, i;
+
+  /* Double when far behind, so we catch up in a few intervals */
+  if (queued >= (uint64_t)size)
+    want = size * 2;
+  else if (queued > 0 && utilization > GROW_UTILIZATION)
+    want = size + (size / 4 > 1 ? size / 4 : 1);
+  else if (queued == 0 && utilization < SHRINK_UTILIZATION)
+    want = size - (size / 8 > 1 ? size / 8 : 1);
+
+  if (want > pool_max)
+    want = pool_max;
+  if (want < pool_min)
+    want = pool_min;
+
+  if (want == size)
+    return;
+
+  log_info("[Postgres][%d][%d] Resizing the pool from %d to %d connections, utilization %.0f%%, %llu queued",
+    pool->target->id, pool->id, size, want, utilization * 100, queued);
+
+  /* Into the free slots */
+  for (i = 0; i < MAX_POOL_SIZE && size < want; i++) {
+    if (__atomic_load_n(&pool->workers[i].running, __ATOMIC_SEQ_CST))
+      continue;
+
+    if (postgres_worker_start(pool, i))
+      return;
+
+    size++;
+  }
+
+  /* Whoever reads a NULL next exits, the queue is empty so it's right away */
+  for (; size > want; size--) {
+    __atomic_add_fetch(&pool->retiring, 1, __ATOMIC_SEQ_CST);
+
+    if (write(pool->pipes[1], &null, sizeof(null)) != sizeof(null)) {
+      __atomic_sub_fetch(&pool->retiring, 1, __ATOMIC_SEQ_CST);
+      return;
+    }
+  }
+}
+
+static void *postgres_controller(void *arg) {
+  uint64_t last = now_usec();
+  int t, p;
+
+  while (1) {
+    sleep(CONTROLLER_INTERVAL);
+
+    uint64_t now = now_usec();
+
+    for (t = 0; t < ntargets; t++) {
+      for (p = 0; p < targets[t].npools; p++)
+        postgres_resize(&targets[t].pools[p], now - last);
+    }
+
+    last = now;
+  }
+
+  return NULL;
+}
+
+/*
+ * Record results of every statement, one file per target.
+ */
+static int postgres_results_init(void) {
+  int t;
+  char *results_file = getenv("RESULTS_FILE");
+
+  if (results_file == NULL)
+    return 0;
+
+  for (t = 0; t < ntargets; t++) {
+    char fn[strlen(results_file) + 8];
+
+    if (ntargets > 1)
+      sprintf(fn, "%s.%d", results_file, t);
+    else
+      sprintf(fn, "%s", results_file);
+
+    if ((targets[t].results = results_open(fn)) == NULL)
+      return -1;
+
+    log_info("[%d] Recording results to %s", t, fn);
   }
 
   return 0;
@@ -80,51 +574,128 @@ int postgres_init(void) {
  * The worker.
  */
 static void *postgres_worker(void *arg) {
-  int id = *(int*)arg;
+  struct Worker *worker = (struct Worker*)arg;
+  struct Pool *pool = worker->pool;
+  int t = pool->target->id;
+  int id = worker->id;
   size_t nread = 0;
-  PGconn *conn = conns[id];
 
-  log_info("Worker %d ready", id);
+  log_info("[%d][%d] Worker %d ready", t, pool->id, id);
 
   while(1) {
 
     /* Wait for work from the main thread */
     struct PStatement *stmt;
-    nread = read(pipes[0], &stmt, sizeof(stmt));
+    nread = read(pool->pipes[0], &stmt, sizeof(stmt));
 
     if (nread != sizeof(stmt)) {
-      log_info("[%d] partial read", id);
+      log_info("[%d][%d][%d] partial read", t, pool->id, id);
       abort(); /* No partial reads on 8 bytes of data, but if that happens, blow up */
     }
 
     if (stmt == NULL) {
-      log_info("[%d] Null pointer in work queue", id);
+      if (postgres_retire(worker))
+        return NULL;
+
+      log_info("[%d][%d][%d] Null pointer in work queue", t, pool->id, id);
       continue;
     }
 
     /* Execute query in thread */
-    postgres_pexec(stmt, conn);
+    postgres_pexec(stmt, worker);
+    __atomic_sub_fetch(&pool->in_flight, 1, __ATOMIC_SEQ_CST);
 
-    /* Clean up */
-    pstatement_free(stmt);
+    /* Clean up, the last target to finish frees it */
+    postgres_release(stmt);
   }
 
   return NULL;
 }
 
 /*
- * Add work to the queue.
+ * Done with the statement for one target.
+ */
+static void postgres_release(struct PStatement *stmt) {
+  uint32_t size = stmt->size;
+
+  if (pstatement_release(stmt))
+    inflight_done(size);
+}
+
+/*
+ * Pick the pool for the statement: writes go to the primary,
+ * reads to the replica with the least statements in flight.
+ *
+ * kind caches the classification between targets, -1 if not done yet.
+ */
+static struct Pool *postgres_route(struct Target *target, struct PStatement *stmt, int *kind) {
+  struct Pool *best;
+  uint64_t best_in_flight;
+  int i;
+
+  if (target->npools == 1)
+    return &target->pools[0];
+
+  if (*kind == -1)
+    *kind = classify_cached(stmt->fingerprint, stmt->query);
+
+  if (*kind != KIND_READ)
+    return &target->pools[0];
+
+  best = &target->pools[1];
+  best_in_flight = __atomic_load_n(&best->in_flight, __ATOMIC_SEQ_CST);
+
+  for (i = 2; i < target->npools; i++) {
+    uint64_t in_flight = __atomic_load_n(&target->pools[i].in_flight, __ATOMIC_SEQ_CST);
+
+    if (in_flight < best_in_flight) {
+      best = &target->pools[i];
+      best_in_flight = in_flight;
+    }
+  }
+
+  return best;
+}
+
+/*
+ * Add work to the queue of every target.
  */
 void postgres_assign(struct PStatement *stmt) {
-  /* Let the kernel handle the scheduling */
-  write(pipes[1], &stmt, sizeof(stmt));
+  int i, kind = -1;
+
+  /* Set before the first write, a worker could be done before we are. */
+  __atomic_store_n(&stmt->refs, ntargets, __ATOMIC_SEQ_CST);
+
+  if (pgstat_enabled())
+    stmt->queued = now_usec();
+
+  for (i = 0; i < ntargets; i++) {
+    struct Target *target = &targets[i];
+    struct Pool *pool = postgres_route(target, stmt, &kind);
+
+    __atomic_add_fetch(&pool->in_flight, 1, __ATOMIC_SEQ_CST);
+
+    /* Let the kernel handle the scheduling */
+    if (write(pool->pipes[1], &stmt, sizeof(stmt)) != sizeof(stmt)) {
+      /* Queue full in independent mode, this target falls behind. */
+      __atomic_sub_fetch(&pool->in_flight, 1, __ATOMIC_SEQ_CST);
+      __atomic_add_fetch(&target->skipped, 1, __ATOMIC_SEQ_CST);
+      postgres_release(stmt);
+    }
+    else {
+      __atomic_add_fetch(&pool->sent, 1, __ATOMIC_SEQ_CST);
+    }
+  }
 }
 
 
 /*
  * Prepared statement execution.
  */
-static void postgres_pexec(struct PStatement *stmt, PGconn *conn) {
+static void postgres_pexec(struct PStatement *stmt, struct Worker *worker) {
+  struct Target *target = worker->pool->target;
+  PGconn *conn = worker->conn;
+  uint32_t timeout = timeout_for(stmt->fingerprint);
   int i;
   const char *params[stmt->np];
 
@@ -134,14 +705,18 @@ static void postgres_pexec(struct PStatement *stmt, PGconn *conn) {
 
   /* Skip transactional indicators for now, we can't guarantee per-client connections yet. */
   if (ignore_transction_blocks(stmt->query)) {
-    __atomic_add_fetch(&ignored, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&target->ignored, 1, __ATOMIC_SEQ_CST);
     return;
   }
 
   if (DEBUG) {
-    log_info("[Postgres][%u] Executing %s", stmt->client_id, stmt->query);
+    log_info("[Postgres][%d][%u] Executing %s", target->id, stmt->client_id, stmt->query);
   }
 
+  /* The server went away or closed the connection since the last statement */
+  if (PQstatus(conn) == CONNECTION_BAD)
+    postgres_reconnect(worker);
+
   /* Check connection status */
   switch(PQtransactionStatus(conn)) {
     case PQTRANS_INTRANS:
@@ -159,7 +734,30 @@ static void postgres_pexec(struct PStatement *stmt, PGconn *conn) {
       break;
   }
 
-  PGresult *res = PQexecParams(
+  struct timespec start, end;
+  struct Execution exec;
+
+  memset(&exec, 0, sizeof(exec));
+  memcpy(exec.sqlstate, "00000", sizeof(exec.sqlstate));
+  exec.status = PGRES_COMMAND_OK;
+
+  /* A cancel for the previous statement may still be on its way, don't let it hit this one */
+  if (__atomic_load_n(&worker->cancelling, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&worker->lock);
+    postgres_cancel_wait(worker);
+    pthread_mutex_unlock(&worker->lock);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (timeout > 0) {
+    pthread_mutex_lock(&worker->lock);
+    worker->deadline = now_usec() + (uint64_t)timeout * 1000;
+    worker->cancelled = 0;
+    pthread_mutex_unlock(&worker->lock);
+  }
+
+  if (!PQsendQueryParams(
     conn,
     stmt->query,
     stmt->np,
@@ -168,21 +766,210 @@ static void postgres_pexec(struct PStatement *stmt, PGconn *conn) {
     NULL,
     NULL,
     0
-  );
+  )) {
+    exec.status = PGRES_FATAL_ERROR;
+    log_info("[Postgres][%d] %s | %s", target->id, stmt->query, PQerrorMessage(conn));
+  }
+  else {
+    /* Rows arrive and are thrown away one at a time, no matter how big the result is. */
+    PQsetSingleRowMode(conn);
+    postgres_consume(stmt, target, conn, &exec);
+  }
 
-  switch (PQresultStatus(res)) {
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (timeout > 0) {
+    pthread_mutex_lock(&worker->lock);
+    worker->deadline = 0;
+    pthread_mutex_unlock(&worker->lock);
+  }
+
+  enum ResultOutcome outcome;
+
+  switch (exec.status) {
     case PGRES_TUPLES_OK:
     case PGRES_COMMAND_OK: {
-      __atomic_add_fetch(&ok, 1, __ATOMIC_SEQ_CST);
+      outcome = OUTCOME_OK;
+      __atomic_add_fetch(&target->ok, 1, __ATOMIC_SEQ_CST);
       break;
     }
     default: {
-      __atomic_add_fetch(&not_ok, 1, __ATOMIC_SEQ_CST);
-      log_info("[Postgres] %s | %s | %s", PQresStatus(PQresultStatus(res)), stmt->query, PQerrorMessage(conn));
+      /* query_canceled, and we are the ones who canceled it */
+      if (worker->cancelled && memcmp(exec.sqlstate, "57014", sizeof(exec.sqlstate)) == 0) {
+        outcome = OUTCOME_TIMEOUT;
+        __atomic_add_fetch(&target->timeouts, 1, __ATOMIC_SEQ_CST);
+      }
+      else {
+        outcome = OUTCOME_ERROR;
+        __atomic_add_fetch(&target->not_ok, 1, __ATOMIC_SEQ_CST);
+      }
     }
   }
 
-  PQclear(res);
+  __atomic_add_fetch(&target->rows, exec.rows, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&target->bytes, exec.bytes, __ATOMIC_SEQ_CST);
+
+  uint64_t latency = (end.tv_sec - start.tv_sec) * SECOND + (end.tv_nsec - start.tv_nsec) / 1000;
+
+  __atomic_add_fetch(&worker->pool->busy, latency, __ATOMIC_SEQ_CST);
+
+  /* The server the collector is looking at */
+  if (target->id == 0 && worker->pool->id == 0 && pgstat_enabled()) {
+    uint64_t started = (uint64_t)start.tv_sec * SECOND + start.tv_nsec / 1000;
+    pgstat_record(stmt->fingerprint, started > stmt->queued ? started - stmt->queued : 0, latency);
+  }
+
+  if (target->results != NULL) {
+    struct ResultRecord record;
+
+    memset(&record, 0, sizeof(record));
+    record.seq = stmt->seq;
+    record.fingerprint = stmt->fingerprint;
+    record.latency = latency;
+    record.rows = exec.rows;
+    record.hash = exec.hash;
+    record.outcome = outcome;
+    memcpy(record.sqlstate, exec.sqlstate, sizeof(record.sqlstate));
+
+    results_write(target->results, &record);
+  }
+}
+
+/*
+ * Wait for the watchdog to be done with the cancel handle, with the worker lock held.
+ */
+static void postgres_cancel_wait(struct Worker *worker) {
+  while (worker->cancelling)
+    pthread_cond_wait(&worker->cancel_sent, &worker->lock);
+}
+
+/*
+ * Cancel statements past their deadline.
+ *
+ * The worker holds its lock while it starts and finishes a statement, and
+ * waits for a cancel still being sent before it starts the next one, so we
+ * never cancel a statement that came after the late one. PQcancel() is a
+ * round trip to the server, it runs without the lock.
+ */
+static void *postgres_watchdog(void *arg) {
+  char errbuf[256];
+  int t, p, i;
+
+  while (1) {
+    uint64_t now = now_usec();
+
+    for (t = 0; t < ntargets; t++) {
+      for (p = 0; p < targets[t].npools; p++) {
+        struct Pool *pool = &targets[t].pools[p];
+        int slots = __atomic_load_n(&pool->slots, __ATOMIC_SEQ_CST);
+
+        for (i = 0; i < slots; i++) {
+          struct Worker *worker = &pool->workers[i];
+
+          PGcancel *cancel = NULL;
+
+          pthread_mutex_lock(&worker->lock);
+
+          if (worker->running && worker->deadline > 0 && now > worker->deadline && !worker->cancelled) {
+            cancel = worker->cancel;
+            worker->cancelled = 1;
+            __atomic_store_n(&worker->cancelling, 1, __ATOMIC_SEQ_CST);
+          }
+
+          pthread_mutex_unlock(&worker->lock);
+
+          if (cancel == NULL)
+            continue;
+
+          if (!PQcancel(cancel, errbuf, sizeof(errbuf)))
+            log_info("[Postgres][%d][%d][%d] Could not cancel statement: %s", t, p, i, errbuf);
+
+          pthread_mutex_lock(&worker->lock);
+          __atomic_store_n(&worker->cancelling, 0, __ATOMIC_SEQ_CST);
+          pthread_cond_broadcast(&worker->cancel_sent);
+          pthread_mutex_unlock(&worker->lock);
+        }
+      }
+    }
+
+    usleep(WATCHDOG_INTERVAL);
+  }
+
+  return NULL;
+}
+
+/*
+ * Read all results of the statement sent on conn, counting rows and bytes.
+ *
+ * The first error wins, later results are still read so the connection
+ * is ready for the next statement.
+ */
+static void postgres_consume(struct PStatement *stmt, struct Target *target, PGconn *conn, struct Execution *exec) {
+  PGresult *res;
+  int failed = 0;
+
+  while ((res = PQgetResult(conn)) != NULL) {
+    ExecStatusType status = PQresultStatus(res);
+
+    switch (status) {
+      case PGRES_SINGLE_TUPLE: {
+        exec->rows++;
+        exec->bytes += postgres_consume_row(res, target->results != NULL ? &exec->hash : NULL);
+        break;
+      }
+
+      case PGRES_TUPLES_OK:
+      case PGRES_COMMAND_OK: {
+        if (!failed)
+          exec->status = status;
+        break;
+      }
+
+      default: {
+        if (!failed) {
+          const char *sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+
+          if (sqlstate != NULL)
+            memcpy(exec->sqlstate, sqlstate, sizeof(exec->sqlstate));
+
+          exec->status = status;
+          failed = 1;
+          log_info("[Postgres][%d] %s | %s | %s", target->id, PQresStatus(status), stmt->query, PQresultErrorMessage(res));
+        }
+      }
+    }
+
+    PQclear(res);
+  }
+}
+
+/*
+ * Size of a single row result, hashing it too if hash is not NULL.
+ *
+ * Row hashes are added up, so the hash doesn't depend on the order
+ * of rows, which is not stable for queries without ORDER BY.
+ */
+static uint64_t postgres_consume_row(PGresult *res, uint64_t *hash) {
+  int col, ncols = PQnfields(res);
+  uint64_t row_hash = FNV_OFFSET, bytes = 0;
+
+  for (col = 0; col < ncols; col++) {
+    int32_t len = PQgetisnull(res, 0, col) ? -1 : PQgetlength(res, 0, col);
+
+    if (len > 0)
+      bytes += len;
+
+    if (hash != NULL) {
+      row_hash = fnv1a(row_hash, &len, sizeof(len));
+      if (len > 0)
+        row_hash = fnv1a(row_hash, PQgetvalue(res, 0, col), len);
+    }
+  }
+
+  if (hash != NULL)
+    *hash += row_hash;
+
+  return bytes;
 }
 
 static int ignore_transction_blocks(char *stmt) {
@@ -215,33 +1002,164 @@ static int ignore_transction_blocks(char *stmt) {
  * Shutdown pool.
  */
 void postgres_free(void) {
-  int i;
+  int i, t, p;
 
-  for (i = 0; i < POOL_SIZE; i++) {
-    /* Kill, best effort, we don't really clean up! Main thread will exit immediately. */
-    pthread_cancel(threads[i]);
+  if (watchdog_running) {
+    pthread_cancel(watchdog);
+    pthread_join(watchdog, NULL);
+    watchdog_running = 0;
+  }
 
-    /* Clean up */
-    PQfinish(conns[i]);
-    conns[i] = NULL;
+  if (monitor_running) {
+    pthread_cancel(monitor);
+    pthread_join(monitor, NULL);
+    monitor_running = 0;
   }
+
+  /* Before the workers, it starts and stops them */
+  if (controller_running) {
+    pthread_cancel(controller);
+    pthread_join(controller, NULL);
+    controller_running = 0;
+  }
+
+  for (t = 0; t < ntargets; t++) {
+    struct Target *target = &targets[t];
+
+    for (p = 0; p < target->npools; p++) {
+      struct Pool *pool = &target->pools[p];
+
+      /* Kill, best effort, we don't really clean up! Main thread will exit immediately. */
+      for (i = 0; i < pool->slots; i++) {
+        if (pool->workers[i].joinable)
+          pthread_cancel(pool->threads[i]);
+      }
+
+      /* Workers write results, wait for them before closing the file. */
+      for (i = 0; i < pool->slots; i++) {
+        if (pool->workers[i].joinable) {
+          pthread_join(pool->threads[i], NULL);
+          pool->workers[i].joinable = 0;
+        }
+      }
+
+      for (i = 0; i < pool->slots; i++) {
+        /* Clean up, retired workers did already */
+        if (!pool->workers[i].running)
+          continue;
+
+        PQfreeCancel(pool->workers[i].cancel);
+        pool->workers[i].cancel = NULL;
+        PQfinish(pool->workers[i].conn);
+        pool->workers[i].conn = NULL;
+        pool->workers[i].running = 0;
+      }
+
+      if (pool->monitor != NULL) {
+        PQfinish(pool->monitor);
+        pool->monitor = NULL;
+      }
+
+      free(pool->url);
+      pool->url = NULL;
+      free(pool->host);
+      pool->host = NULL;
+    }
+
+    results_close(target->results);
+    target->results = NULL;
+  }
+
+  timeouts_free();
+}
+
+/*
+ * Seconds since the replica replayed the last transaction from its primary,
+ * -1 if unknown.
+ */
+static double postgres_replication_lag(struct Pool *pool) {
+  double lag = -1;
+  PGresult *res = PQexec(pool->monitor, "SELECT EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp())");
+
+  if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1 && !PQgetisnull(res, 0, 0))
+    lag = atof(PQgetvalue(res, 0, 0));
+
+  PQclear(res);
+  return lag;
+}
+
+/*
+ * Check the replication lag of every replica in the background, the stats
+ * only show the last value so they don't wait on the replicas.
+ */
+static void *postgres_monitor(void *arg) {
+  int t, p;
+
+  while (1) {
+    for (t = 0; t < ntargets; t++) {
+      for (p = 1; p < targets[t].npools; p++) {
+        struct Pool *pool = &targets[t].pools[p];
+        double lag;
+
+        if (PQstatus(pool->monitor) == CONNECTION_BAD)
+          PQreset(pool->monitor);
+
+        /* -1 is unknown, a clock a bit ahead of the primary is no lag */
+        lag = postgres_replication_lag(pool);
+        __atomic_store_n(&pool->lag, lag == -1 ? -1 : lag < 0 ? 0 : (int64_t)(lag * SECOND), __ATOMIC_SEQ_CST);
+      }
+    }
+
+    sleep(MONITOR_INTERVAL);
+  }
+
+  return NULL;
 }
 
 /*
  * Show some stats. They are not exact, since this is multi-threaded.
  */
 void postgres_stats(void) {
-  uint64_t l_ok = 0, l_not_ok = 0, l_ignored = 0;
+  int t, p;
+
+  for (t = 0; t < ntargets; t++) {
+    struct Target *target = &targets[t];
+    int connections = 0;
+
+    for (p = 0; p < target->npools; p++)
+      connections += __atomic_load_n(&target->pools[p].size, __ATOMIC_SEQ_CST);
+
+    /* Load and reset stats */
+    uint64_t l_ok = __atomic_exchange_n(&target->ok, 0, __ATOMIC_SEQ_CST);
+    uint64_t l_not_ok = __atomic_exchange_n(&target->not_ok, 0, __ATOMIC_SEQ_CST);
+    uint64_t l_ignored = __atomic_exchange_n(&target->ignored, 0, __ATOMIC_SEQ_CST);
+    uint64_t l_skipped = __atomic_exchange_n(&target->skipped, 0, __ATOMIC_SEQ_CST);
+    uint64_t l_timeouts = __atomic_exchange_n(&target->timeouts, 0, __ATOMIC_SEQ_CST);
+    uint64_t l_rows = __atomic_exchange_n(&target->rows, 0, __ATOMIC_SEQ_CST);
+    uint64_t l_bytes = __atomic_exchange_n(&target->bytes, 0, __ATOMIC_SEQ_CST);
+    uint64_t l_reconnects = __atomic_exchange_n(&target->reconnects, 0, __ATOMIC_SEQ_CST);
 
-  /* Load stats */
-  __atomic_load(&ok, &l_ok, __ATOMIC_SEQ_CST);
-  __atomic_load(&not_ok, &l_not_ok, __ATOMIC_SEQ_CST);
-  __atomic_load(&ignored, &l_ignored, __ATOMIC_SEQ_CST);
+    log_info("[Postgres][%d][Statistics] %s: OK: %llu; Error: %llu; Timeout: %llu; Ignored: %llu; Skipped: %llu; Rows: %llu; Bytes: %llu; Connections: %d; Reconnects: %llu.",
+      target->id, target->pools[0].host, l_ok, l_not_ok, l_timeouts, l_ignored, l_skipped, l_rows, l_bytes, connections, l_reconnects);
 
-  log_info("[Postgres][Statistics] OK: %llu; Error: %llu; Ignored: %llu.", l_ok, l_not_ok, l_ignored);
+    if (target->npools == 1)
+      continue;
+
+    for (p = 0; p < target->npools; p++) {
+      struct Pool *pool = &target->pools[p];
+      uint64_t l_sent = __atomic_exchange_n(&pool->sent, 0, __ATOMIC_SEQ_CST);
+      uint64_t l_in_flight = __atomic_load_n(&pool->in_flight, __ATOMIC_SEQ_CST);
+
+      if (p == 0) {
+        log_info("[Postgres][%d][%d][Statistics] Primary %s: Sent: %llu; In flight: %llu.",
+          target->id, p, pool->host, l_sent, l_in_flight);
+      }
+      else {
+        int64_t lag = __atomic_load_n(&pool->lag, __ATOMIC_SEQ_CST);
 
-  /* Reset stats */
-  __atomic_store_n(&ok, 0, __ATOMIC_SEQ_CST);
-  __atomic_store_n(&not_ok, 0, __ATOMIC_SEQ_CST);
-  __atomic_store_n(&ignored, 0, __ATOMIC_SEQ_CST);
+        log_info("[Postgres][%d][%d][Statistics] Replica %s: Sent: %llu; In flight: %llu; Replication lag: %.3f seconds.",
+          target->id, p, pool->host, l_sent, l_in_flight, lag < 0 ? -1.0 : (double)lag / SECOND);
+      }
+    }
+  }
 }
@@ -0,0 +1,304 @@
+/*
+ * Token bucket rate limits.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ratelimit.h"
+#include "helpers.h"
+#include "replayer.h"
+#include "classify.h"
+
+#define BURST 0.01 /* Seconds worth of tokens saved up while idle */
+
+struct Bucket {
+  const char *name;
+  pthread_mutex_t lock;
+  double rate; /* Per second, 0 is unlimited */
+  double tokens; /* Negative when statements are waiting */
+  uint64_t last; /* Last refill */
+
+  /* Stats, see ratelimit_stats() */
+  uint64_t admitted, waited, waited_usec;
+};
+
+enum BucketId {
+  BUCKET_GLOBAL,
+  BUCKET_READ,
+  BUCKET_WRITE,
+  NBUCKETS,
+};
+
+static struct Bucket buckets[NBUCKETS] = {
+  { "global", PTHREAD_MUTEX_INITIALIZER },
+  { "read", PTHREAD_MUTEX_INITIALIZER },
+  { "write", PTHREAD_MUTEX_INITIALIZER },
+};
+
+static int enabled = 0;
+static double step = 10;
+static char *control_file = NULL;
+static uint64_t stats_start = 0;
+
+/* Set by the signal handlers, applied by the next statement. Atomic, a signal can come in between a read and a write. */
+static int steps = 0, reload = 0;
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void bucket_set(struct Bucket *bucket, double rate) {
+  pthread_mutex_lock(&bucket->lock);
+
+  bucket->rate = rate > 0 ? rate : 0;
+  bucket->last = now_usec();
+  if (bucket->tokens > 0)
+    bucket->tokens = 0;
+
+  pthread_mutex_unlock(&bucket->lock);
+}
+
+static void ratelimit_log(void) {
+  char line[256];
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < NBUCKETS; i++) {
+    if (buckets[i].rate > 0)
+      len += snprintf(line + len, sizeof(line) - len, "%s%s %.0f/s", len ? ", " : "", buckets[i].name, buckets[i].rate);
+  }
+
+  log_info("[RateLimit] Limits: %s", len ? line : "none");
+}
+
+/*
+ * Lines of "<bucket> <rate>", # for comments.
+ */
+static int ratelimit_load(const char *fn) {
+  char line[256], name[32];
+  double rate;
+  FILE *f = fopen(fn, "r");
+  int i, n = 0;
+
+  if (f == NULL) {
+    log_info("[RateLimit] Could not open %s", fn);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%31s %lf", name, &rate) != 2)
+      continue;
+
+    for (i = 0; i < NBUCKETS; i++) {
+      if (strcmp(name, buckets[i].name) == 0) {
+        bucket_set(&buckets[i], rate);
+        n++;
+        break;
+      }
+    }
+
+    if (i == NBUCKETS)
+      log_info("[RateLimit] Unknown limit %s in %s", name, fn);
+  }
+
+  fclose(f);
+  return n;
+}
+
+static void on_step(int signo) {
+  __atomic_add_fetch(&steps, signo == SIGUSR1 ? 1 : -1, __ATOMIC_SEQ_CST);
+}
+
+static void on_reload(int signo) {
+  __atomic_store_n(&reload, 1, __ATOMIC_SEQ_CST);
+}
+
+int ratelimit_init(void) {
+  char *env;
+
+  if ((env = getenv("RATE_LIMIT")) != NULL)
+    bucket_set(&buckets[BUCKET_GLOBAL], atof(env));
+
+  if ((env = getenv("RATE_LIMIT_READ")) != NULL)
+    bucket_set(&buckets[BUCKET_READ], atof(env));
+
+  if ((env = getenv("RATE_LIMIT_WRITE")) != NULL)
+    bucket_set(&buckets[BUCKET_WRITE], atof(env));
+
+  if ((env = getenv("RATE_LIMIT_STEP")) != NULL && atof(env) > 0)
+    step = atof(env);
+
+  if ((control_file = getenv("RATE_LIMIT_FILE")) != NULL && ratelimit_load(control_file) < 0)
+    return -1;
+
+  enabled = buckets[BUCKET_GLOBAL].rate > 0 || buckets[BUCKET_READ].rate > 0 ||
+    buckets[BUCKET_WRITE].rate > 0 || control_file != NULL;
+
+  if (!enabled)
+    return 0;
+
+  signal(SIGUSR1, on_step);
+  signal(SIGUSR2, on_step);
+
+  if (control_file != NULL)
+    signal(SIGHUP, on_reload);
+
+  stats_start = now_usec();
+  ratelimit_log();
+
+  return 0;
+}
+
+/*
+ * Apply what the signals asked for.
+ */
+static void ratelimit_control(void) {
+  int i, n;
+
+  pthread_mutex_lock(&control_lock);
+
+  if (__atomic_exchange_n(&reload, 0, __ATOMIC_SEQ_CST)) {
+    ratelimit_load(control_file);
+    ratelimit_log();
+  }
+
+  if ((n = __atomic_exchange_n(&steps, 0, __ATOMIC_SEQ_CST)) != 0) {
+    double factor = 1;
+
+    for (; n > 0; n--)
+      factor *= 1 + step / 100;
+    for (; n < 0; n++)
+      factor *= 1 - step / 100;
+
+    /* Unlimited stays unlimited */
+    for (i = 0; i < NBUCKETS; i++) {
+      if (buckets[i].rate > 0)
+        bucket_set(&buckets[i], buckets[i].rate * factor < 1 ? 1 : buckets[i].rate * factor);
+    }
+
+    ratelimit_log();
+  }
+
+  pthread_mutex_unlock(&control_lock);
+}
+
+/*
+ * Take a token for a statement going at the earliest at, reserving one in
+ * the future if there's none left by then. Returns how long to wait from now,
+ * in microseconds; only the wait past at is this bucket's doing.
+ */
+static uint64_t bucket_take(struct Bucket *bucket, uint64_t at) {
+  uint64_t now, wait = 0, ready, due;
+  double burst;
+
+  pthread_mutex_lock(&bucket->lock);
+
+  now = now_usec();
+  ready = at > now ? at : now;
+
+  if (bucket->rate > 0) {
+    bucket->tokens += (double)(now - bucket->last) * bucket->rate / SECOND;
+    bucket->last = now;
+
+    burst = bucket->rate * BURST > 1 ? bucket->rate * BURST : 1;
+    if (bucket->tokens > burst)
+      bucket->tokens = burst;
+
+    bucket->tokens -= 1;
+
+    /* The tokens coming in until the statement goes are its to use */
+    due = bucket->tokens < 0 ? now + (uint64_t)(-bucket->tokens / bucket->rate * SECOND) : now;
+    if (due > ready) {
+      wait = due - ready;
+      ready = due;
+    }
+  }
+
+  pthread_mutex_unlock(&bucket->lock);
+
+  if (wait) {
+    __atomic_add_fetch(&bucket->waited, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bucket->waited_usec, wait, __ATOMIC_RELAXED);
+  }
+
+  return ready - now;
+}
+
+static void sleep_usec(uint64_t usec) {
+  struct timespec ts = { usec / SECOND, (usec % SECOND) * 1000 };
+  while (nanosleep(&ts, &ts) != 0)
+    ;
+}
+
+static struct Bucket *kind_bucket(struct PStatement *stmt) {
+  enum StatementKind kind;
+
+  if (buckets[BUCKET_READ].rate == 0 && buckets[BUCKET_WRITE].rate == 0)
+    return NULL;
+
+  kind = classify_cached(stmt->fingerprint, stmt->query);
+  return &buckets[kind == KIND_READ ? BUCKET_READ : BUCKET_WRITE];
+}
+
+void ratelimit_wait(struct PStatement *stmt) {
+  struct Bucket *kind;
+  uint64_t wait = 0;
+
+  if (!enabled)
+    return;
+
+  if (__atomic_load_n(&steps, __ATOMIC_RELAXED) != 0 || __atomic_load_n(&reload, __ATOMIC_RELAXED))
+    ratelimit_control();
+
+  /* The kind decides when the statement could go, the global token is reserved for then */
+  if ((kind = kind_bucket(stmt)) != NULL)
+    wait = bucket_take(kind, 0);
+
+  wait = bucket_take(&buckets[BUCKET_GLOBAL], now_usec() + wait);
+
+  if (wait)
+    sleep_usec(wait);
+}
+
+void ratelimit_admitted(struct PStatement *stmt) {
+  struct Bucket *kind;
+
+  if (!enabled)
+    return;
+
+  __atomic_add_fetch(&buckets[BUCKET_GLOBAL].admitted, 1, __ATOMIC_RELAXED);
+
+  if ((kind = kind_bucket(stmt)) != NULL)
+    __atomic_add_fetch(&kind->admitted, 1, __ATOMIC_RELAXED);
+}
+
+void ratelimit_stats(void) {
+  uint64_t now;
+  double seconds;
+  int i;
+
+  if (!enabled)
+    return;
+
+  now = now_usec();
+  seconds = (double)(now - stats_start) / SECOND;
+  stats_start = now;
+
+  for (i = 0; i < NBUCKETS; i++) {
+    struct Bucket *bucket = &buckets[i];
+    uint64_t admitted = __atomic_exchange_n(&bucket->admitted, 0, __ATOMIC_RELAXED);
+    uint64_t waited = __atomic_exchange_n(&bucket->waited, 0, __ATOMIC_RELAXED);
+    uint64_t waited_usec = __atomic_exchange_n(&bucket->waited_usec, 0, __ATOMIC_RELAXED);
+
+    if (bucket->rate == 0)
+      continue;
+
+    log_info("[RateLimit][Statistics] %s: Achieved: %.0f/s; Configured: %.0f/s; Waited: %llu statements for %.2f seconds.",
+      bucket->name, seconds > 0 ? admitted / seconds : 0, bucket->rate, waited, (double)waited_usec / SECOND);
+  }
+}
@@ -0,0 +1,185 @@
+/*
+ * Compress a packet log for replay, see PACKET_FILE.
+ *
+ * Usage: recompress <in> <out> [zstd|lz4] [level]
+ *
+ * The input may itself be compressed, so this also converts between formats.
+ * Level 0 is the library default.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "replayer.h"
+#include "helpers.h"
+#include "segment.h"
+
+int DEBUG = 0;
+
+#define CHUNK (128 * 1024)
+
+#ifdef HAVE_ZSTD
+static int compress_zstd(FILE *in, FILE *out, int level) {
+  ZSTD_CCtx *cctx = ZSTD_createCCtx();
+  size_t out_size = ZSTD_CStreamOutSize();
+  char *in_buf = malloc(CHUNK), *out_buf = malloc(out_size);
+  size_t n;
+  int done = 0, res = 0;
+
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+
+  while (!done && res == 0) {
+    ZSTD_EndDirective mode;
+    ZSTD_inBuffer input;
+
+    n = fread(in_buf, 1, CHUNK, in);
+    done = n < CHUNK;
+    mode = done ? ZSTD_e_end : ZSTD_e_continue;
+    input = (ZSTD_inBuffer){ in_buf, n, 0 };
+
+    for (;;) {
+      ZSTD_outBuffer output = { out_buf, out_size, 0 };
+      size_t remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+
+      if (ZSTD_isError(remaining)) {
+        fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(remaining));
+        res = 1;
+        break;
+      }
+
+      fwrite(out_buf, 1, output.pos, out);
+
+      if (done ? remaining == 0 : input.pos == input.size)
+        break;
+    }
+  }
+
+  ZSTD_freeCCtx(cctx);
+  free(in_buf);
+  free(out_buf);
+  return res;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static int compress_lz4(FILE *in, FILE *out, int level) {
+  LZ4F_cctx *cctx;
+  LZ4F_preferences_t prefs;
+  size_t out_size = LZ4F_compressBound(CHUNK, NULL) + LZ4F_HEADER_SIZE_MAX;
+  char *in_buf = malloc(CHUNK), *out_buf = malloc(out_size);
+  size_t n, ret;
+  int res = 0;
+
+  memset(&prefs, 0, sizeof(prefs));
+  prefs.compressionLevel = level;
+  prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+
+  LZ4F_createCompressionContext(&cctx, LZ4F_VERSION);
+
+  ret = LZ4F_compressBegin(cctx, out_buf, out_size, &prefs);
+  if (LZ4F_isError(ret))
+    goto error;
+  fwrite(out_buf, 1, ret, out);
+
+  while ((n = fread(in_buf, 1, CHUNK, in)) > 0) {
+    ret = LZ4F_compressUpdate(cctx, out_buf, out_size, in_buf, n, NULL);
+    if (LZ4F_isError(ret))
+      goto error;
+    fwrite(out_buf, 1, ret, out);
+  }
+
+  ret = LZ4F_compressEnd(cctx, out_buf, out_size, NULL);
+  if (LZ4F_isError(ret))
+    goto error;
+  fwrite(out_buf, 1, ret, out);
+  goto done;
+
+error:
+  fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(ret));
+  res = 1;
+
+done:
+  LZ4F_freeCompressionContext(cctx);
+  free(in_buf);
+  free(out_buf);
+  return res;
+}
+#endif
+
+int main(int argc, char **argv) {
+  struct Segment segment;
+  enum SegmentFormat format = SEGMENT_ZSTD;
+  FILE *in, *out;
+  int level = 0, res = 1;
+
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <in> <out> [zstd|lz4] [level]\n", argv[0]);
+    return 2;
+  }
+
+  if (argc > 3) {
+    if (strcmp(argv[3], "lz4") == 0)
+      format = SEGMENT_LZ4;
+    else if (strcmp(argv[3], "zstd") != 0) {
+      fprintf(stderr, "Unknown format %s\n", argv[3]);
+      return 2;
+    }
+  }
+
+  if (argc > 4)
+    level = atoi(argv[4]);
+
+  if (!segment_supported(format)) {
+    fprintf(stderr, "Built without %s\n", argv[3] ? argv[3] : "zstd");
+    return 2;
+  }
+
+  if ((in = segment_open(&segment, argv[1])) == NULL) {
+    fprintf(stderr, "Could not read %s\n", argv[1]);
+    return 1;
+  }
+
+  if ((out = fopen(argv[2], "w")) == NULL) {
+    fprintf(stderr, "Could not write %s\n", argv[2]);
+    segment_close(&segment);
+    return 1;
+  }
+
+  switch (format) {
+#ifdef HAVE_ZSTD
+    case SEGMENT_ZSTD:
+      res = compress_zstd(in, out, level);
+      break;
+#endif
+#ifdef HAVE_LZ4
+    case SEGMENT_LZ4:
+      res = compress_lz4(in, out, level);
+      break;
+#endif
+    default:
+      (void)level; /* Built without zstd and LZ4 */
+      break;
+  }
+
+  /* A read error or a truncated compressed input is not a copy */
+  if (segment_close(&segment)) {
+    fprintf(stderr, "Could not read all of %s\n", argv[1]);
+    res = 1;
+  }
+
+  if (fclose(out) != 0)
+    res = 1;
+
+  return res;
+}
@@ -0,0 +1,86 @@
+/*
+ * Per statement result recording.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "results.h"
+#include "helpers.h"
+
+/*
+ * Open a result file for writing, truncating it.
+ */
+struct ResultWriter *results_open(const char *fn) {
+  FILE *f = fopen(fn, "w");
+
+  if (f == NULL) {
+    log_info("[Results] Could not open %s: %s", fn, strerror(errno));
+    return NULL;
+  }
+
+  fwrite(RESULTS_MAGIC, RESULTS_MAGIC_LEN, 1, f);
+
+  struct ResultWriter *writer = malloc(sizeof(struct ResultWriter));
+  writer->f = f;
+  pthread_mutex_init(&writer->lock, NULL);
+
+  return writer;
+}
+
+/*
+ * Append a record. Shared by all workers of a target, stdio buffers for us.
+ */
+void results_write(struct ResultWriter *writer, struct ResultRecord *record) {
+  pthread_mutex_lock(&writer->lock);
+  fwrite(record, sizeof(struct ResultRecord), 1, writer->f);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+/*
+ * Flush and close. Workers must be stopped by now.
+ */
+void results_close(struct ResultWriter *writer) {
+  if (writer == NULL)
+    return;
+
+  fclose(writer->f);
+  pthread_mutex_destroy(&writer->lock);
+  free(writer);
+}
+
+/*
+ * Read a whole result file into memory.
+ */
+ssize_t results_load(const char *fn, struct ResultRecord **records) {
+  char magic[RESULTS_MAGIC_LEN];
+  size_t cap = 4096, n = 0;
+  FILE *f = fopen(fn, "r");
+
+  if (f == NULL) {
+    log_info("[Results] Could not open %s: %s", fn, strerror(errno));
+    return -1;
+  }
+
+  if (fread(magic, RESULTS_MAGIC_LEN, 1, f) != 1 || memcmp(magic, RESULTS_MAGIC, RESULTS_MAGIC_LEN)) {
+    log_info("[Results] %s is not a result file", fn);
+    fclose(f);
+    return -1;
+  }
+
+  *records = malloc(cap * sizeof(struct ResultRecord));
+
+  while (fread(&(*records)[n], sizeof(struct ResultRecord), 1, f) == 1) {
+    n++;
+    if (n == cap) {
+      cap *= 2;
+      *records = realloc(*records, cap * sizeof(struct ResultRecord));
+    }
+  }
+
+  fclose(f);
+  return n;
+}
@@ -0,0 +1,296 @@
+/*
+ * Packet log segment reader.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "segment.h"
+#include "helpers.h"
+#include "replayer.h"
+
+#define READ_SIZE (128 * 1024)
+
+const char *segment_format_name(enum SegmentFormat format) {
+  switch (format) {
+    case SEGMENT_ZSTD:
+      return "zstd";
+    case SEGMENT_LZ4:
+      return "lz4";
+    default:
+      return "raw";
+  }
+}
+
+/* Totals since the last segment_stats() */
+static uint64_t total_compressed = 0, total_decompressed = 0, total_usec = 0, total_failed = 0;
+
+int segment_supported(enum SegmentFormat format) {
+  switch (format) {
+    case SEGMENT_RAW:
+      return 1;
+#ifdef HAVE_ZSTD
+    case SEGMENT_ZSTD:
+      return 1;
+#endif
+#ifdef HAVE_LZ4
+    case SEGMENT_LZ4:
+      return 1;
+#endif
+    default:
+      return 0;
+  }
+}
+
+enum SegmentFormat segment_format(FILE *f) {
+  unsigned char magic[4];
+  uint32_t value;
+  enum SegmentFormat format = SEGMENT_RAW;
+
+  if (fread(magic, 1, sizeof(magic), f) == sizeof(magic)) {
+    /* Both are little endian */
+    value = magic[0] | (magic[1] << 8) | (magic[2] << 16) | ((uint32_t)magic[3] << 24);
+
+    if (value == ZSTD_MAGIC)
+      format = SEGMENT_ZSTD;
+    else if (value == LZ4_MAGIC)
+      format = SEGMENT_LZ4;
+  }
+
+  rewind(f);
+  return format;
+}
+
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+/*
+ * Write everything, the parser may be slower than us.
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1; /* Parser went away */
+    }
+
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int decompress_zstd(struct Segment *segment, char *in_buf, char *out_buf, size_t out_size) {
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  size_t n, ret = 0;
+  int res = 0;
+
+  while (res == 0 && (n = fread(in_buf, 1, READ_SIZE, segment->raw)) > 0) {
+    ZSTD_inBuffer in = { in_buf, n, 0 };
+    segment->compressed += n;
+
+    while (in.pos < in.size) {
+      ZSTD_outBuffer out = { out_buf, out_size, 0 };
+      uint64_t start = now_usec();
+      ret = ZSTD_decompressStream(dctx, &out, &in);
+      segment->usec += now_usec() - start;
+
+      if (ZSTD_isError(ret)) {
+        log_info("[Segment] zstd: %s", ZSTD_getErrorName(ret));
+        res = -1;
+        break;
+      }
+
+      segment->decompressed += out.pos;
+
+      if (write_all(segment->pipes[1], out_buf, out.pos)) {
+        res = -1;
+        break;
+      }
+    }
+  }
+
+  /* Frame not finished, the segment was truncated */
+  if (res == 0 && ret != 0)
+    res = -1;
+
+  ZSTD_freeDCtx(dctx);
+  return res;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static int decompress_lz4(struct Segment *segment, char *in_buf, char *out_buf, size_t out_size) {
+  LZ4F_dctx *dctx;
+  size_t n, ret = 0;
+  int res = 0;
+
+  if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+    return -1;
+
+  while (res == 0 && (n = fread(in_buf, 1, READ_SIZE, segment->raw)) > 0) {
+    size_t pos = 0;
+    segment->compressed += n;
+
+    while (pos < n) {
+      size_t dst_size = out_size, src_size = n - pos;
+      uint64_t start = now_usec();
+      ret = LZ4F_decompress(dctx, out_buf, &dst_size, in_buf + pos, &src_size, NULL);
+      segment->usec += now_usec() - start;
+
+      if (LZ4F_isError(ret)) {
+        log_info("[Segment] lz4: %s", LZ4F_getErrorName(ret));
+        res = -1;
+        break;
+      }
+
+      pos += src_size;
+      segment->decompressed += dst_size;
+
+      if (write_all(segment->pipes[1], out_buf, dst_size)) {
+        res = -1;
+        break;
+      }
+    }
+  }
+
+  /* Frame not finished, the segment was truncated */
+  if (res == 0 && ret != 0)
+    res = -1;
+
+  LZ4F_freeDecompressionContext(dctx);
+  return res;
+}
+#endif
+
+/*
+ * Decompress the segment into the pipe the parser reads from.
+ */
+static void *segment_decompress(void *arg) {
+  struct Segment *segment = (struct Segment *)arg;
+  size_t out_size = READ_SIZE * 4;
+  char *in_buf = malloc(READ_SIZE), *out_buf = malloc(out_size);
+  sigset_t sigpipe;
+
+  /* Get EPIPE instead of getting killed if the parser stops early */
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+  switch (segment->format) {
+#ifdef HAVE_ZSTD
+    case SEGMENT_ZSTD:
+      segment->failed = decompress_zstd(segment, in_buf, out_buf, out_size);
+      break;
+#endif
+#ifdef HAVE_LZ4
+    case SEGMENT_LZ4:
+      segment->failed = decompress_lz4(segment, in_buf, out_buf, out_size);
+      break;
+#endif
+    default:
+      segment->failed = -1;
+  }
+
+  /* EOF for the parser */
+  close(segment->pipes[1]);
+
+  free(in_buf);
+  free(out_buf);
+  return NULL;
+}
+
+FILE *segment_open(struct Segment *segment, const char *fn) {
+  memset(segment, 0, sizeof(struct Segment));
+
+  if ((segment->raw = fopen(fn, "r")) == NULL)
+    return NULL;
+
+  segment->format = segment_format(segment->raw);
+
+  if (segment->format == SEGMENT_RAW) {
+    segment->f = segment->raw;
+    return segment->f;
+  }
+
+  if (!segment_supported(segment->format)) {
+    log_info("[Segment] %s is %s compressed, but we were built without %s", fn,
+      segment_format_name(segment->format), segment_format_name(segment->format));
+    fclose(segment->raw);
+    return NULL;
+  }
+
+  if (pipe(segment->pipes) == -1) {
+    log_info("[Segment] pipe: %s", strerror(errno));
+    fclose(segment->raw);
+    return NULL;
+  }
+
+  segment->f = fdopen(segment->pipes[0], "r");
+  pthread_create(&segment->thread, NULL, segment_decompress, segment);
+
+  return segment->f;
+}
+
+int segment_close(struct Segment *segment) {
+  /* Read error, from the file or the decompressor */
+  if (ferror(segment->f))
+    segment->failed = -1;
+
+  /* Closing our end first lets the decompressor quit if we stopped early */
+  fclose(segment->f);
+
+  if (segment->format != SEGMENT_RAW) {
+    pthread_join(segment->thread, NULL);
+    fclose(segment->raw);
+
+    __atomic_add_fetch(&total_compressed, segment->compressed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&total_decompressed, segment->decompressed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&total_usec, segment->usec, __ATOMIC_RELAXED);
+  }
+
+  if (!segment->failed)
+    return 0;
+
+  log_info("[Segment] Could not read the whole %s segment", segment_format_name(segment->format));
+  __atomic_add_fetch(&total_failed, 1, __ATOMIC_RELAXED);
+
+  return -1;
+}
+
+void segment_stats(void) {
+  uint64_t compressed = __atomic_exchange_n(&total_compressed, 0, __ATOMIC_RELAXED);
+  uint64_t decompressed = __atomic_exchange_n(&total_decompressed, 0, __ATOMIC_RELAXED);
+  uint64_t usec = __atomic_exchange_n(&total_usec, 0, __ATOMIC_RELAXED);
+  uint64_t failed = __atomic_exchange_n(&total_failed, 0, __ATOMIC_RELAXED);
+
+  if (failed > 0)
+    log_info("[Segment][Statistics] Segments not read in full: %llu.", failed);
+
+  if (compressed == 0)
+    return;
+
+  log_info("[Segment][Statistics] Read %llu compressed bytes into %llu bytes, ratio %.2f; decompressed at %.1f MB/s.",
+    compressed, decompressed, (double)decompressed / compressed,
+    usec > 0 ? (double)decompressed / usec : 0);
+}
@@ -0,0 +1,223 @@
+/*
+ * Stream sketches: HyperLogLog, count-min, top K and histograms.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "sketch.h"
+
+uint64_t sketch_hash(uint64_t value) {
+  /* splitmix64 finalizer */
+  value += 0x9E3779B97F4A7C15ULL;
+  value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+  return value ^ (value >> 31);
+}
+
+/*
+ * HyperLogLog
+ */
+void hll_init(struct Hll *hll, int p) {
+  hll->p = p;
+  hll->registers = calloc((size_t)1 << p, 1);
+}
+
+void hll_add(struct Hll *hll, uint64_t hash) {
+  uint64_t index = hash >> (64 - hll->p), rest = hash << hll->p;
+  uint8_t rank = rest == 0 ? 64 - hll->p + 1 : __builtin_clzll(rest) + 1;
+
+  if (rank > hll->registers[index])
+    hll->registers[index] = rank;
+}
+
+double hll_estimate(struct Hll *hll) {
+  size_t i, m = (size_t)1 << hll->p, zeros = 0;
+  double sum = 0, alpha = 0.7213 / (1 + 1.079 / m), estimate;
+
+  for (i = 0; i < m; i++) {
+    sum += ldexp(1.0, -hll->registers[i]);
+    if (hll->registers[i] == 0)
+      zeros++;
+  }
+
+  estimate = alpha * m * m / sum;
+
+  /* Small range correction, linear counting */
+  if (estimate <= 2.5 * m && zeros > 0)
+    estimate = m * log((double)m / zeros);
+
+  return estimate;
+}
+
+void hll_clear(struct Hll *hll) {
+  memset(hll->registers, 0, (size_t)1 << hll->p);
+}
+
+void hll_free(struct Hll *hll) {
+  free(hll->registers);
+  hll->registers = NULL;
+}
+
+/*
+ * Count-min
+ */
+void countmin_init(struct CountMin *cm) {
+  cm->counters = calloc((size_t)CM_DEPTH * CM_WIDTH, sizeof(uint32_t));
+}
+
+uint32_t countmin_add(struct CountMin *cm, uint64_t hash) {
+  uint32_t h1 = hash, h2 = (hash >> 32) | 1, estimate = UINT32_MAX;
+  int i;
+
+  /* Derive the row hashes from one, Kirsch-Mitzenmacher */
+  for (i = 0; i < CM_DEPTH; i++) {
+    uint32_t *counter = &cm->counters[i * CM_WIDTH + ((h1 + i * h2) & (CM_WIDTH - 1))];
+
+    if (*counter < UINT32_MAX)
+      (*counter)++;
+
+    if (*counter < estimate)
+      estimate = *counter;
+  }
+
+  return estimate;
+}
+
+void countmin_free(struct CountMin *cm) {
+  free(cm->counters);
+  cm->counters = NULL;
+}
+
+/*
+ * Top K
+ */
+static void topk_swap(struct TopK *topk, int a, int b) {
+  struct TopKEntry tmp = topk->heap[a];
+  topk->heap[a] = topk->heap[b];
+  topk->heap[b] = tmp;
+}
+
+static void topk_down(struct TopK *topk, int i) {
+  for (;;) {
+    int smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+
+    if (l < topk->len && topk->heap[l].count < topk->heap[smallest].count)
+      smallest = l;
+    if (r < topk->len && topk->heap[r].count < topk->heap[smallest].count)
+      smallest = r;
+
+    if (smallest == i)
+      return;
+
+    topk_swap(topk, i, smallest);
+    i = smallest;
+  }
+}
+
+static void topk_up(struct TopK *topk, int i) {
+  while (i > 0 && topk->heap[i].count < topk->heap[(i - 1) / 2].count) {
+    topk_swap(topk, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+void topk_offer(struct TopK *topk, uint64_t key, uint32_t count, int kind, const char *sample) {
+  struct TopKEntry *entry;
+  int i;
+
+  for (i = 0; i < topk->len; i++) {
+    if (topk->heap[i].key == key) {
+      topk->heap[i].count = count;
+      topk_down(topk, i);
+      return;
+    }
+  }
+
+  if (topk->len < TOPK_SIZE) {
+    i = topk->len++;
+  }
+  else if (count > topk->heap[0].count) {
+    i = 0;
+  }
+  else {
+    return;
+  }
+
+  entry = &topk->heap[i];
+  entry->key = key;
+  entry->count = count;
+  entry->kind = kind;
+  strncpy(entry->sample, sample, TOPK_SAMPLE - 1);
+  entry->sample[TOPK_SAMPLE - 1] = '\0';
+
+  if (i == 0)
+    topk_down(topk, 0);
+  else
+    topk_up(topk, i);
+}
+
+static int topk_cmp(const void *a, const void *b) {
+  const struct TopKEntry *ea = a, *eb = b;
+  return (ea->count < eb->count) - (ea->count > eb->count);
+}
+
+void topk_sort(struct TopK *topk) {
+  qsort(topk->heap, topk->len, sizeof(struct TopKEntry), topk_cmp);
+}
+
+/*
+ * Histogram
+ */
+int histogram_bucket(uint64_t value) {
+  int e;
+
+  if (value < HIST_SUB)
+    return value;
+
+  e = 63 - __builtin_clzll(value);
+  return HIST_SUB + (e - HIST_SUB_BITS) * HIST_SUB + ((value >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+uint64_t histogram_bucket_max(int bucket) {
+  int e, sub;
+
+  if (bucket < HIST_SUB)
+    return bucket;
+
+  e = (bucket - HIST_SUB) / HIST_SUB + HIST_SUB_BITS;
+  sub = (bucket - HIST_SUB) % HIST_SUB;
+
+  return ((uint64_t)(HIST_SUB + sub) << (e - HIST_SUB_BITS)) + ((uint64_t)1 << (e - HIST_SUB_BITS)) - 1;
+}
+
+void histogram_add(struct Histogram *hist, uint64_t value) {
+  if (hist->count == 0 || value < hist->min)
+    hist->min = value;
+  if (value > hist->max)
+    hist->max = value;
+
+  hist->count++;
+  hist->sum += value;
+  hist->buckets[histogram_bucket(value)]++;
+}
+
+uint64_t histogram_quantile(struct Histogram *hist, double q) {
+  uint64_t rank = (uint64_t)ceil(q * hist->count), seen = 0;
+  int i;
+
+  if (rank == 0)
+    rank = 1;
+
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+
+    /* Never beyond what we've actually seen */
+    if (seen >= rank)
+      return histogram_bucket_max(i) < hist->max ? histogram_bucket_max(i) : hist->max;
+  }
+
+  return hist->max;
+}
@@ -0,0 +1,278 @@
+/*
+ * Packet log rotation and partitioning.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/file.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "spool.h"
+#include "helpers.h"
+#include "replayer.h"
+
+static int partition = 0, npartitions = 1;
+
+/* Throttle logging */
+static int erred = 0;
+
+/* Running totals, for the combined statistics */
+static uint64_t total_sent = 0, total_dropped = 0;
+static uint64_t started = 0;
+
+int spool_init(void) {
+  char *env = getenv("PARTITION");
+
+  started = now_usec();
+
+  if (env == NULL)
+    return 0;
+
+  if (sscanf(env, "%d/%d", &partition, &npartitions) != 2 || npartitions < 1 || partition < 0 || partition >= npartitions) {
+    log_info("[Spool] PARTITION must be k/K with 0 <= k < K, got %s", env);
+    return -1;
+  }
+
+  log_info("[Spool] Replaying partition %d of %d", partition, npartitions);
+  return 0;
+}
+
+int spool_partitions(void) {
+  return npartitions;
+}
+
+uint32_t spool_hash(uint32_t client_id) {
+  return client_hash(client_id) >> 16;
+}
+
+int spool_owns(uint32_t client_id) {
+  return npartitions == 1 || spool_hash(client_id) % npartitions == (uint32_t)partition;
+}
+
+/*
+ * Take the rotation lock, NULL if we can't.
+ */
+static FILE *spool_lock(const char *fn) {
+  char lock_fn[strlen(fn) + 6];
+
+  /* lock file for concurrent log file access */
+  sprintf(lock_fn, "%s.lock", fn);
+
+  FILE *fd = fopen(lock_fn, "w");
+
+  if (fd == NULL) {
+    log_info("[Rotation] Could not open %s: %s", lock_fn, strerror(errno));
+    return NULL;
+  }
+
+  /* Try again if we can't get a lock */
+  if (flock(fileno(fd), LOCK_EX)) {
+    log_info("[Rotation] Could not get lock on %s: %s", lock_fn, strerror(errno));
+    fclose(fd);
+    return NULL;
+  }
+
+  return fd;
+}
+
+static void spool_unlock(FILE *fd) {
+  flock(fileno(fd), LOCK_UN);
+  fclose(fd);
+}
+
+/*
+ * Rotate packet logfile so the bouncer can log some more.
+ */
+static int rotate_logfile(char *new_fn, const char *fn) {
+  int res;
+  FILE *fd;
+
+  /* rotate log file to this */
+  sprintf(new_fn, "%s.1", fn);
+
+  /* Get exclusive lock & rotate */
+  if ((fd = spool_lock(fn)) == NULL)
+    return 1;
+
+  /* Rotate */
+  if ((res = rename(fn, new_fn))) {
+    if (!erred) { /* log errors only once per occurence */
+      log_info("[Rotation] Could not rename %s: %s", fn, strerror(errno));
+      erred = 1;
+    }
+  }
+  else
+    erred = 0;
+
+  spool_unlock(fd);
+  return res;
+}
+
+/*
+ * Oldest segment left for us, 1 if none.
+ */
+static int spool_find(char *segment, size_t len, const char *fn) {
+  char dir_buf[strlen(fn) + 1], base_buf[strlen(fn) + 1];
+  char suffix[16];
+  char *dir, *base;
+  struct dirent *entry;
+  uint64_t best = UINT64_MAX;
+  DIR *d;
+
+  strcpy(dir_buf, fn);
+  strcpy(base_buf, fn);
+  dir = dirname(dir_buf);
+  base = basename(base_buf);
+  sprintf(suffix, ".p%d", partition);
+
+  if ((d = opendir(dir)) == NULL) {
+    log_info("[Spool] Could not open %s: %s", dir, strerror(errno));
+    return 1;
+  }
+
+  while ((entry = readdir(d)) != NULL) {
+    size_t base_len = strlen(base), name_len = strlen(entry->d_name), suffix_len = strlen(suffix);
+    uint64_t seq;
+    char *end;
+
+    /* <base>.<seq>.p<k> */
+    if (name_len <= base_len + 1 + suffix_len || strncmp(entry->d_name, base, base_len) || entry->d_name[base_len] != '.')
+      continue;
+
+    if (strcmp(entry->d_name + name_len - suffix_len, suffix))
+      continue;
+
+    seq = strtoull(entry->d_name + base_len + 1, &end, 10);
+
+    if (end != entry->d_name + name_len - suffix_len)
+      continue;
+
+    if (seq < best)
+      best = seq;
+  }
+
+  closedir(d);
+
+  if (best == UINT64_MAX)
+    return 1;
+
+  snprintf(segment, len, "%s.%020" PRIu64 "%s", fn, best, suffix);
+  return 0;
+}
+
+/*
+ * Rotate the packet log into one link per partition.
+ */
+static int spool_rotate(const char *fn) {
+  char spooled[strlen(fn) + 32], link_fn[strlen(fn) + 48];
+  struct timespec now;
+  uint64_t seq;
+  int i, res = 0;
+  FILE *fd;
+
+  /* Wall clock, so segments sort by age between restarts */
+  clock_gettime(CLOCK_REALTIME, &now);
+  seq = (uint64_t)now.tv_sec * SECOND + now.tv_nsec / 1000;
+
+  if ((fd = spool_lock(fn)) == NULL)
+    return 1;
+
+  snprintf(spooled, sizeof(spooled), "%s.%020" PRIu64, fn, seq);
+
+  if (rename(fn, spooled)) {
+    if (!erred) { /* log errors only once per occurence */
+      log_info("[Rotation] Could not rename %s: %s", fn, strerror(errno));
+      erred = 1;
+    }
+    spool_unlock(fd);
+    return 1;
+  }
+
+  erred = 0;
+
+  for (i = 0; i < npartitions; i++) {
+    snprintf(link_fn, sizeof(link_fn), "%s.p%d", spooled, i);
+
+    if (link(spooled, link_fn)) {
+      log_info("[Spool] Could not link %s: %s", link_fn, strerror(errno));
+      res = 1;
+    }
+  }
+
+  unlink(spooled);
+  spool_unlock(fd);
+  return res;
+}
+
+int spool_next(char *segment, size_t len, const char *fn) {
+  if (npartitions == 1)
+    return rotate_logfile(segment, fn);
+
+  /* Another instance may have rotated for us already */
+  if (spool_find(segment, len, fn) == 0)
+    return 0;
+
+  if (spool_rotate(fn))
+    return 1;
+
+  return spool_find(segment, len, fn);
+}
+
+/*
+ * Each instance writes its totals to <fn>.stats.p<k>.
+ */
+void spool_stats(const char *fn, uint64_t sent, uint64_t dropped) {
+  char stats_fn[strlen(fn) + 32], tmp_fn[strlen(fn) + 40];
+  uint64_t all_sent = 0, all_dropped = 0;
+  int i, reporting = 0;
+  FILE *f;
+
+  total_sent += sent;
+  total_dropped += dropped;
+
+  if (npartitions == 1)
+    return;
+
+  sprintf(stats_fn, "%s.stats.p%d", fn, partition);
+  sprintf(tmp_fn, "%s.tmp", stats_fn);
+
+  /* Instance 0 reads it any time, swap the whole file in */
+  if ((f = fopen(tmp_fn, "w")) != NULL) {
+    fprintf(f, "%" PRIu64 " %" PRIu64 " %" PRIu64 "\n", total_sent, total_dropped, now_usec() - started);
+
+    if (fclose(f) != 0 || rename(tmp_fn, stats_fn) != 0)
+      log_info("[Spool] Could not write %s: %s", stats_fn, strerror(errno));
+  }
+
+  if (partition != 0)
+    return;
+
+  for (i = 0; i < npartitions; i++) {
+    uint64_t i_sent, i_dropped, i_uptime;
+
+    sprintf(stats_fn, "%s.stats.p%d", fn, i);
+
+    if ((f = fopen(stats_fn, "r")) == NULL)
+      continue;
+
+    if (fscanf(f, "%" SCNu64 " %" SCNu64 " %" SCNu64, &i_sent, &i_dropped, &i_uptime) == 3) {
+      all_sent += i_sent;
+      all_dropped += i_dropped;
+      reporting++;
+    }
+
+    fclose(f);
+  }
+
+  log_info("[Spool][Statistics] %d of %d instances reporting, sent %" PRIu64 " queries and dropped %" PRIu64 " packets in total",
+    reporting, npartitions, all_sent, all_dropped);
+}
@@ -8,6 +8,7 @@
 
 #include "statement.h"
 #include "helpers.h"
+#include "fingerprint.h"
 
 #define PARAM_PREALLOC 5
 
@@ -25,6 +26,11 @@ struct PStatement *pstatement_init(char *query, uint32_t client_id) {
 	stmt->sp = PARAM_PREALLOC;
 	stmt->np = 0;
 	stmt->client_id = client_id;
+	stmt->size = sizeof(struct PStatement) + len + 1 + PARAM_PREALLOC * sizeof(struct Parameter *);
+	stmt->seq = 0;
+	stmt->queued = 0;
+	stmt->fingerprint = fingerprint(stmt->query);
+	stmt->refs = 1;
 
 	return stmt;
 }
@@ -37,12 +43,28 @@ void pstatement_add_param(struct PStatement *stmt, struct Parameter *param) {
 		uint16_t new_sp = stmt->sp + PARAM_PREALLOC;
 		stmt->params = realloc(stmt->params, new_sp * sizeof(struct Parameter *));
 		stmt->sp = new_sp;
+		stmt->size += PARAM_PREALLOC * sizeof(struct Parameter *);
 	}
 	stmt->params[stmt->np] = param;
+	stmt->size += sizeof(struct Parameter) + param->len + 1;
 
 	stmt->np++;
 }
 
+/*
+ * Deep copy, without the references.
+ */
+struct PStatement *pstatement_clone(struct PStatement *stmt) {
+	struct PStatement *copy = pstatement_init(stmt->query, stmt->client_id);
+	int i;
+
+	for (i = 0; i < stmt->np; i++) {
+		pstatement_add_param(copy, parameter_init(stmt->params[i]->len, stmt->params[i]->value));
+	}
+
+	return copy;
+}
+
 /*
  * Debug.
  */
@@ -76,3 +98,17 @@ void pstatement_free(struct PStatement *stmt) {
 	free_safe(stmt->query, "pstatement_free");
 	free_safe(stmt, "pstatement_free");
 }
+
+/*
+ * Drop one reference, free when nobody holds the statement anymore.
+ * Returns 1 if it was freed.
+ *
+ * The same statement is shared by the workers of every replay target.
+ */
+int pstatement_release(struct PStatement *stmt) {
+	if (__atomic_sub_fetch(&stmt->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+		pstatement_free(stmt);
+		return 1;
+	}
+	return 0;
+}
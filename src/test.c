@@ -1,2 +1,398 @@
-/* TODO: one day */
-int main () {}
+/*
+ * Unit tests, run with make test.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "helpers.h"
+#include "statement.h"
+#include "parameter.h"
+#include "parser.h"
+#include "inflight.h"
+#include "classify.h"
+#include "fingerprint.h"
+#include "sketch.h"
+#include "clientset.h"
+#include "filter.h"
+#include "ratelimit.h"
+
+int DEBUG = 0;
+
+static int failures = 0;
+
+#define check(cond) do { \
+  if (!(cond)) { \
+    printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+    failures++; \
+  } \
+  } while (0)
+
+/* Last statement the parser handed over */
+static struct PStatement *last = NULL;
+
+static void exec_keep(struct Parser *parser, struct PStatement *stmt) {
+  if (last != NULL)
+    pstatement_free(last);
+  last = stmt;
+}
+
+static size_t put_uint32(char *buf, uint32_t value) {
+  buf[0] = value >> 24;
+  buf[1] = value >> 16;
+  buf[2] = value >> 8;
+  buf[3] = value;
+  return 4;
+}
+
+/*
+ * A packet log record: client id, tag, length, body and the delimiter.
+ */
+static size_t record(char *buf, uint32_t client_id, char tag, const char *body, size_t len) {
+  size_t n = 0;
+
+  n += put_uint32(buf + n, client_id);
+  buf[n++] = tag;
+  n += put_uint32(buf + n, len + 4);
+  memcpy(buf + n, body, len);
+  n += len;
+  buf[n++] = DELIMETER;
+
+  return n;
+}
+
+/* Bytes >= 0x80 used to be sign extended */
+static void test_parse_uint(void) {
+  char b32[4] = { 0x00, 0x00, 0x00, (char)0xC8 };
+  char b32_high[4] = { (char)0x80, (char)0xFF, 0x01, (char)0x90 };
+  char b16[2] = { 0x00, (char)0xC8 };
+  char b16_high[2] = { (char)0xFF, (char)0x80 };
+
+  check(parse_uint32(b32) == 200);
+  check(parse_uint32(b32_high) == 0x80FF0190);
+  check(parse_uint16(b16) == 200);
+  check(parse_uint16(b16_high) == 0xFF80);
+}
+
+/* Client id and parameter length with bytes >= 0x80 */
+static void test_parser_high_bytes(void) {
+  struct Parser *parser = parser_init(0, 1, exec_keep, NULL);
+  char line[1024], body[512], value[200];
+  uint32_t client_id = 0x1234ABCD;
+  size_t len, n;
+
+  memset(value, 'x', sizeof(value));
+
+  len = record(line, client_id, 'Q', "SELECT 1", sizeof("SELECT 1"));
+  parser_record(parser, line, len);
+
+  check(last != NULL && last->client_id == client_id);
+  check(last != NULL && strcmp(last->query, "SELECT 1") == 0);
+
+  /* Parse, Bind with one 200 byte parameter, Execute */
+  len = record(line, client_id, 'P', "\0SELECT $1", sizeof("\0SELECT $1"));
+  parser_record(parser, line, len);
+
+  n = 0;
+  body[n++] = '\0'; /* Portal */
+  body[n++] = '\0'; /* Statement */
+  body[n++] = 0; body[n++] = 0; /* Formats */
+  body[n++] = 0; body[n++] = 1; /* Parameters */
+  n += put_uint32(body + n, sizeof(value));
+  memcpy(body + n, value, sizeof(value));
+  n += sizeof(value);
+  body[n++] = 0; body[n++] = 0; /* Result formats */
+
+  len = record(line, client_id, 'B', body, n);
+  parser_record(parser, line, len);
+
+  len = record(line, client_id, 'E', "\0\0\0\0\0", 5);
+  parser_record(parser, line, len);
+
+  check(last != NULL && strcmp(last->query, "SELECT $1") == 0);
+  check(last != NULL && last->client_id == client_id);
+  check(last != NULL && last->np == 1);
+  check(last != NULL && last->np == 1 && last->params[0]->len == sizeof(value));
+  check(last != NULL && last->np == 1 && memcmp(last->params[0]->value, value, sizeof(value)) == 0);
+  check(parser->dropped == 0);
+
+  if (last != NULL)
+    pstatement_free(last);
+  last = NULL;
+  parser_free(parser);
+}
+
+/*
+ * A worker that stalls, then finishes statements one at a time.
+ */
+#define TEST_IN_FLIGHT 64
+
+static int worker_stop = 0;
+static uint64_t worker_max = 0;
+
+static void *stalled_worker(void *arg) {
+  usleep(20000);
+
+  while (!__atomic_load_n(&worker_stop, __ATOMIC_SEQ_CST)) {
+    uint64_t n = inflight_count();
+
+    if (n > worker_max)
+      worker_max = n;
+    if (n > 0)
+      inflight_done(10);
+
+    usleep(50);
+  }
+
+  return NULL;
+}
+
+static void test_inflight_policy(const char *policy) {
+  struct PStatement stmt;
+  pthread_t worker;
+  int i, admitted = 0, over = 0;
+
+  setenv("MAX_IN_FLIGHT", "64", 1);
+  setenv("OVERLOAD_POLICY", policy, 1);
+  check(inflight_init() == 0);
+
+  memset(&stmt, 0, sizeof(stmt));
+  stmt.size = 10;
+
+  worker_stop = 0;
+  worker_max = 0;
+  pthread_create(&worker, NULL, stalled_worker, NULL);
+
+  /* More clients than the dropped client set holds */
+  for (i = 0; i < 20000; i++) {
+    stmt.client_id = i;
+    admitted += inflight_admit(&stmt);
+
+    if (inflight_count() > TEST_IN_FLIGHT)
+      over++;
+  }
+
+  __atomic_store_n(&worker_stop, 1, __ATOMIC_SEQ_CST);
+  pthread_join(worker, NULL);
+
+  check(over == 0);
+  check(worker_max <= TEST_IN_FLIGHT);
+  check(admitted >= TEST_IN_FLIGHT && admitted < 20000);
+
+  while (inflight_count() > 0)
+    inflight_done(10);
+  inflight_segment_end();
+}
+
+/* Over budget, nothing goes past MAX_IN_FLIGHT while the workers are stuck */
+static void test_inflight_hard_limit(void) {
+  test_inflight_policy("sample");
+  test_inflight_policy("drop-client");
+  unsetenv("MAX_IN_FLIGHT");
+  unsetenv("OVERLOAD_POLICY");
+}
+
+/* Data-modifying CTEs and locking clauses, whatever whitespace is around them */
+static void test_classify(void) {
+  check(classify("SELECT 1") == KIND_READ);
+  check(classify("  /* hi */ (select last_update, update_count FROM t)") == KIND_READ);
+  check(classify("WITH x AS (SELECT 1) SELECT * FROM x") == KIND_READ);
+  check(classify("WITH x AS (INSERT\nINTO t VALUES (1) RETURNING *) SELECT * FROM x") == KIND_WRITE);
+  check(classify("WITH x AS (UPDATE\tt SET a = 1 RETURNING *) SELECT 1") == KIND_WRITE);
+  check(classify("WITH x AS (DELETE FROM t) SELECT 1") == KIND_WRITE);
+  check(classify("SELECT * FROM t FOR\nUPDATE") == KIND_WRITE);
+  check(classify("SELECT * FROM t FOR  NO KEY\tUPDATE") == KIND_WRITE);
+  check(classify("SELECT nextval ('seq')") == KIND_WRITE);
+  check(classify("INSERT INTO t VALUES (1)") == KIND_WRITE);
+  check(classify("CREATE TABLE t (a int)") == KIND_WRITE);
+}
+
+/* Normalized like pg_stat_statements, negative numbers included */
+static void test_fingerprint(void) {
+  check(fingerprint("SELECT * FROM t WHERE a = 5") == fingerprint("select *  from t where a = $1"));
+  check(fingerprint("SELECT * FROM t WHERE a = -1") == fingerprint("SELECT * FROM t WHERE a = $1"));
+  check(fingerprint("SELECT * FROM t WHERE a = - 1.5") == fingerprint("SELECT * FROM t WHERE a = $1"));
+  check(fingerprint("SELECT * FROM t WHERE a IN (-1, -2)") == fingerprint("SELECT * FROM t WHERE a IN ($1, $2)"));
+  check(fingerprint("SELECT -1") == fingerprint("SELECT $1"));
+  check(fingerprint("SELECT a - 1 FROM t") == fingerprint("SELECT a - $1 FROM t"));
+  check(fingerprint("SELECT a - 1 FROM t") != fingerprint("SELECT a $1 FROM t"));
+  check(fingerprint("SELECT (a) - 1 FROM t") == fingerprint("SELECT (a) - $1 FROM t"));
+}
+
+/* Distinct counts, heavy hitters and histogram buckets */
+static void test_sketch(void) {
+  static struct Histogram hist;
+  static struct TopK topk;
+  struct CountMin cm;
+  struct Hll hll;
+  uint64_t v, k, r, i;
+  int b;
+
+  hll_init(&hll, 14);
+  for (i = 0; i < 100000; i++)
+    hll_add(&hll, sketch_hash(i));
+  check(hll_estimate(&hll) > 97000 && hll_estimate(&hll) < 103000);
+  hll_free(&hll);
+
+  /* Key k shows up k + 1 times, interleaved, so the top K changes on the way */
+  countmin_init(&cm);
+  for (r = 0; r < 1000; r++) {
+    for (k = r; k < 1000; k++) {
+      uint32_t count = countmin_add(&cm, sketch_hash(k));
+      if (k == r)
+        check(count >= k + 1 && count <= k + 1 + 2 * 500500 / CM_WIDTH);
+      topk_offer(&topk, k, count, 0, "");
+    }
+  }
+  countmin_free(&cm);
+
+  topk_sort(&topk);
+  check(topk.len == TOPK_SIZE);
+  check(topk.heap[0].key == 999 && topk.heap[0].count >= 1000);
+  for (b = 0; b < topk.len; b++) {
+    check(topk.heap[b].key >= 1000 - TOPK_SIZE - 2 * 500500 / CM_WIDTH);
+    check(b == 0 || topk.heap[b].count <= topk.heap[b - 1].count);
+  }
+
+  /* Every value lands in the bucket whose range holds it */
+  for (v = 0; v < 100000; v++) {
+    b = histogram_bucket(v);
+    check(histogram_bucket_max(b) >= v && (b == 0 || histogram_bucket_max(b - 1) < v));
+  }
+  for (i = 0; i < 64; i++) {
+    v = (uint64_t)1 << i;
+    check(histogram_bucket_max(histogram_bucket(v)) >= v);
+    check(histogram_bucket_max(histogram_bucket(v - 1)) >= v - 1);
+    check(histogram_bucket(v) < HIST_BUCKETS);
+  }
+  check(histogram_bucket(UINT64_MAX) < HIST_BUCKETS && histogram_bucket_max(histogram_bucket(UINT64_MAX)) == UINT64_MAX);
+
+  for (v = 1; v <= 1000; v++)
+    histogram_add(&hist, v);
+  check(histogram_quantile(&hist, 0.5) >= 500 && histogram_quantile(&hist, 0.5) <= 500 * 5 / 4);
+  check(histogram_quantile(&hist, 0.99) >= 990 && histogram_quantile(&hist, 0.99) <= 1000);
+  check(histogram_quantile(&hist, 1) == 1000);
+}
+
+/* A cluster that wraps around the end of the table, clients removed from the middle of it */
+static void test_clientset(void) {
+  static struct ClientSet set;
+  uint32_t ids[] = { 4094, 4094 + CLIENT_SET_SIZE, 4094 + 2 * CLIENT_SET_SIZE, 0, 4095, 1 };
+  int i, n = sizeof(ids) / sizeof(ids[0]);
+
+  for (i = 0; i < n; i++)
+    check(clientset_add(&set, ids[i]));
+  check(set.len == n);
+
+  clientset_remove(&set, ids[0]);
+  check(!clientset_has(&set, ids[0]));
+  for (i = 1; i < n; i++)
+    check(clientset_has(&set, ids[i]));
+
+  clientset_remove(&set, ids[3]);
+  check(!clientset_has(&set, ids[3]));
+  for (i = 1; i < n; i++)
+    check(i == 3 || clientset_has(&set, ids[i]));
+  check(set.len == n - 2);
+
+  check(clientset_add(&set, ids[0]) && clientset_add(&set, ids[3]));
+  for (i = 0; i < n; i++)
+    check(clientset_has(&set, ids[i]));
+  check(set.len == n);
+
+  /* Removing what's not there leaves the set alone */
+  clientset_remove(&set, 7);
+  check(set.len == n);
+
+  clientset_clear(&set);
+  check(set.len == 0 && !clientset_has(&set, ids[1]));
+}
+
+static void test_filter(void) {
+  int i, kept = 0;
+
+  setenv("FILTER_SAMPLE", "50", 1);
+  setenv("FILTER_PREFIX", "SELECT,WITH", 1);
+  setenv("FILTER_KEYWORDS", "users,orders", 1);
+  setenv("FILTER_KIND", "read", 1);
+  check(filter_init() == 0);
+
+  check(filter_query("  select * FROM Users"));
+  check(filter_query("WITH x AS (SELECT 1) SELECT * FROM orders, x"));
+  check(!filter_query("SELECT * FROM accounts"));
+  check(!filter_query("UPDATE users SET a = 1"));
+  check(!filter_query("WITH x AS (DELETE FROM users) SELECT 1"));
+  check(!filter_query("SELECT * FROM users FOR UPDATE"));
+
+  for (i = 0; i < 10000; i++) {
+    kept += filter_client(i);
+    check(filter_client(i) == filter_client(i));
+  }
+  check(kept > 4500 && kept < 5500);
+
+  filter_free();
+  unsetenv("FILTER_SAMPLE");
+  unsetenv("FILTER_PREFIX");
+  unsetenv("FILTER_KEYWORDS");
+  unsetenv("FILTER_KIND");
+}
+
+/*
+ * Statements wait for the tokens coming in at the limit, reads skip the
+ * write bucket. Timing, so the bounds are loose.
+ */
+static void test_ratelimit(void) {
+  struct PStatement read, write;
+  uint64_t start, elapsed;
+  int i;
+
+  memset(&read, 0, sizeof(read));
+  memset(&write, 0, sizeof(write));
+  read.query = "SELECT 1";
+  read.fingerprint = fingerprint(read.query);
+  write.query = "UPDATE t SET a = 1";
+  write.fingerprint = fingerprint(write.query);
+
+  setenv("RATE_LIMIT_WRITE", "1000", 1);
+  check(ratelimit_init() == 0);
+
+  start = now_usec();
+  for (i = 0; i < 100; i++)
+    ratelimit_wait(&read);
+  elapsed = now_usec() - start;
+  check(elapsed < 50000);
+
+  start = now_usec();
+  for (i = 0; i < 200; i++)
+    ratelimit_wait(&write);
+  elapsed = now_usec() - start;
+  check(elapsed >= 190000 && elapsed < 400000);
+
+  unsetenv("RATE_LIMIT_WRITE");
+}
+
+int main() {
+  test_parse_uint();
+  test_parser_high_bytes();
+  test_inflight_hard_limit();
+  test_classify();
+  test_fingerprint();
+  test_sketch();
+  test_clientset();
+  test_filter();
+  test_ratelimit();
+
+  if (failures) {
+    printf("%d failed\n", failures);
+    return 1;
+  }
+
+  printf("OK\n");
+  return 0;
+}
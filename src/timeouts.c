@@ -0,0 +1,113 @@
+/*
+ * Statement deadlines.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "timeouts.h"
+#include "helpers.h"
+
+struct Timeout {
+  uint64_t fingerprint;
+  uint32_t ms;
+  int used;
+};
+
+/* Read-only once loaded, so workers can look up without locking. */
+static struct Timeout *table = NULL;
+static size_t table_cap = 0;
+static uint32_t default_ms = 0;
+
+static void timeouts_set(uint64_t fingerprint, uint32_t ms) {
+  size_t i;
+
+  for (i = fingerprint & (table_cap - 1); ; i = (i + 1) & (table_cap - 1)) {
+    if (!table[i].used || table[i].fingerprint == fingerprint) {
+      table[i].fingerprint = fingerprint;
+      table[i].ms = ms;
+      table[i].used = 1;
+      return;
+    }
+  }
+}
+
+/*
+ * Load the timeouts from the environment.
+ */
+int timeouts_init(void) {
+  char *timeout = getenv("STATEMENT_TIMEOUT");
+  char *timeout_file = getenv("STATEMENT_TIMEOUT_FILE");
+  char line[256];
+  size_t lines = 0;
+  FILE *f;
+
+  if (timeout != NULL) {
+    default_ms = atoi(timeout);
+  }
+
+  if (timeout_file == NULL) {
+    return 0;
+  }
+
+  if ((f = fopen(timeout_file, "r")) == NULL) {
+    log_info("[Timeouts] Could not open %s: %s", timeout_file, strerror(errno));
+    return -1;
+  }
+
+  /* Size the table for at most half full */
+  while (fgets(line, sizeof(line), f) != NULL)
+    lines++;
+
+  for (table_cap = 16; table_cap < lines * 2; table_cap *= 2)
+    ;
+
+  table = calloc(table_cap, sizeof(struct Timeout));
+  rewind(f);
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    uint64_t fingerprint;
+    uint32_t ms;
+
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+
+    if (sscanf(line, "%" SCNx64 " %" SCNu32, &fingerprint, &ms) != 2) {
+      log_info("[Timeouts] Ignoring malformed line: %s", line);
+      continue;
+    }
+
+    timeouts_set(fingerprint, ms);
+  }
+
+  fclose(f);
+  return 0;
+}
+
+uint32_t timeout_for(uint64_t fingerprint) {
+  size_t i;
+
+  if (table == NULL)
+    return default_ms;
+
+  for (i = fingerprint & (table_cap - 1); table[i].used; i = (i + 1) & (table_cap - 1)) {
+    if (table[i].fingerprint == fingerprint)
+      return table[i].ms;
+  }
+
+  return default_ms;
+}
+
+int timeouts_enabled(void) {
+  return default_ms > 0 || table != NULL;
+}
+
+void timeouts_free(void) {
+  free(table);
+  table = NULL;
+  table_cap = 0;
+}
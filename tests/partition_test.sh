@@ -0,0 +1,83 @@
+#!/bin/bash
+
+#
+# Replay a generated packet log with two partitioned instances against mockpg
+# and check that they split the clients: no client on both, none missing.
+#
+
+if [[ ! -d .git ]]; then
+	echo "Run me from the root of the repository."
+	exit 1
+fi
+
+if [[ ! -f ./player || ! -f ./mockpg || ! -f ./pktgen ]]; then
+	echo "Run make debug, make mockpg and make pktgen first."
+	exit 1
+fi
+
+# How long each run gets, the packet log takes a couple of seconds
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-8}
+
+export DATABASE_URL="postgres://mock@127.0.0.1:${MOCK_PORT:-5433}/mock"
+export DEBUG=1
+
+dir=$(mktemp -d)
+trap 'kill $mock 2>/dev/null; rm -rf $dir' EXIT
+
+./mockpg > $dir/mockpg.log 2>&1 &
+mock=$!
+sleep 1
+
+./pktgen -n 20000 -c 500 $dir/pktlog > /dev/null
+
+# Clients of the executed statements, from the DEBUG=1 log
+clients() {
+	grep -o '\[Postgres\]\[0\]\[[0-9]*\] Executing' $1 | cut -d '[' -f 4 | cut -d ']' -f 1 | sort -u
+}
+
+# Everything, from one instance
+mkdir $dir/all
+cp $dir/pktlog $dir/all/pktlog
+PACKET_FILE=$dir/all/pktlog timeout -s INT $SECONDS_PER_RUN ./player > $dir/all.log 2>&1
+
+# Two instances sharing the packet log
+mkdir $dir/split
+cp $dir/pktlog $dir/split/pktlog
+PARTITION=0/2 PACKET_FILE=$dir/split/pktlog timeout -s INT $SECONDS_PER_RUN ./player > $dir/p0.log 2>&1 &
+p0=$!
+PARTITION=1/2 PACKET_FILE=$dir/split/pktlog timeout -s INT $SECONDS_PER_RUN ./player > $dir/p1.log 2>&1 &
+p1=$!
+wait $p0 $p1
+
+clients $dir/all.log > $dir/all.clients
+clients $dir/p0.log > $dir/p0.clients
+clients $dir/p1.log > $dir/p1.clients
+
+echo "Clients: $(wc -l < $dir/all.clients) in total, $(wc -l < $dir/p0.clients) in partition 0, $(wc -l < $dir/p1.clients) in partition 1."
+
+failed=0
+
+if [[ ! -s $dir/all.clients ]]; then
+	echo "FAIL: nothing was replayed, see the logs:"
+	tail -5 $dir/all.log
+	exit 1
+fi
+
+both=$(comm -12 $dir/p0.clients $dir/p1.clients | wc -l)
+if [[ $both -ne 0 ]]; then
+	echo "FAIL: $both clients replayed by both instances"
+	failed=1
+fi
+
+sort -u $dir/p0.clients $dir/p1.clients > $dir/split.clients
+if ! cmp -s $dir/all.clients $dir/split.clients; then
+	echo "FAIL: the instances together didn't replay the same clients as one instance"
+	diff $dir/all.clients $dir/split.clients | head
+	failed=1
+fi
+
+if [[ $failed -eq 0 ]]; then
+	echo "OK"
+fi
+
+exit $failed
@@ -0,0 +1,98 @@
+#!/bin/bash
+
+#
+# Replay generated packet logs against mockpg with an adaptive pool, restart
+# mockpg in the middle of the first one and check that the workers reconnect,
+# the pool resizes and every statement of the first two logs is executed.
+#
+
+if [[ ! -d .git ]]; then
+	echo "Run me from the root of the repository."
+	exit 1
+fi
+
+if [[ ! -f ./player || ! -f ./mockpg || ! -f ./pktgen ]]; then
+	echo "Run make debug, make mockpg and make pktgen first."
+	exit 1
+fi
+
+STATEMENTS=5000
+
+export DATABASE_URL="postgres://mock@127.0.0.1:${MOCK_PORT:-5433}/mock"
+export MOCK_LATENCY_US=${MOCK_LATENCY_US:-1000}
+export POOL_SIZE=2 POOL_MIN=2 POOL_MAX=32
+
+dir=$(mktemp -d)
+trap 'kill $mock $player 2>/dev/null; rm -rf $dir' EXIT
+
+for i in 1 2 3; do
+	./pktgen -n $STATEMENTS -c 200 -S $i $dir/segment.$i > /dev/null
+done
+
+feed() {
+	cp $dir/segment.$1 $dir/pktlog.tmp
+	mv $dir/pktlog.tmp $dir/pktlog
+}
+
+./mockpg > $dir/mockpg.log 2>&1 &
+mock=$!
+sleep 1
+
+PACKET_FILE=$dir/pktlog ./player > $dir/player.log 2>&1 &
+player=$!
+
+# Drop every connection while the first log is replayed
+feed 1
+sleep 1
+kill $mock
+wait $mock 2>/dev/null
+sleep 1
+./mockpg >> $dir/mockpg.log 2>&1 &
+mock=$!
+
+# The statistics of a log are logged once it's parsed, the third one shows what the second did
+sleep 5
+feed 2
+sleep 5
+feed 3
+sleep 2
+
+kill -INT $player
+wait $player
+
+# Sum of a field of the [Postgres] statistics
+total() {
+	grep -o "\[Postgres\]\[0\]\[Statistics\].*" $dir/player.log | grep -o "$1: [0-9]*" | awk '{ n += $2 } END { print n + 0 }'
+}
+
+ok=$(total OK)
+error=$(total Error)
+reconnects=$(total Reconnects)
+resizes=$(grep -c "Resizing the pool" $dir/player.log)
+
+echo "Statements: $ok OK, $error errors; Reconnects: $reconnects; Resizes: $resizes."
+
+failed=0
+
+if [[ $reconnects -eq 0 ]]; then
+	echo "FAIL: no worker reconnected"
+	failed=1
+fi
+
+if [[ $resizes -eq 0 ]]; then
+	echo "FAIL: the pool was never resized"
+	failed=1
+fi
+
+# The ones in flight when mockpg went away fail, none may be left in the queue
+if [[ $((ok + error)) -lt $((2 * STATEMENTS)) ]]; then
+	echo "FAIL: the queue stopped draining after the restart, see the log:"
+	grep "Statistics\] \|Reconnect\|lost" $dir/player.log | tail -5
+	failed=1
+fi
+
+if [[ $failed -eq 0 ]]; then
+	echo "OK"
+fi
+
+exit $failed